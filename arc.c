@@ -1,36 +1,52 @@
 #include "arc.h"
 #include <ctype.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
 
-char *error_string[] = { "", "Syntax error", "Symbol not bound", "Wrong number of arguments", "Wrong type", "File error", "" };
-size_t stack_capacity = 0;
-size_t stack_size = 0;
-atom *stack = NULL;
-struct pair *pair_head = NULL;
-struct str *str_head = NULL;
-struct table *table_head = NULL;
-size_t alloc_count = 0;
-size_t alloc_count_old = 0;
-char **symbol_table = NULL;
-size_t symbol_size = 0;
-size_t symbol_capacity = 0;
+char *error_string[] = { "", "Syntax error", "Symbol not bound", "Wrong number of arguments", "Wrong type", "File error", "", "Stack overflow", "Continuation not active", "" };
 const atom nil = { T_NIL };
-atom env; /* the global environment */
-/* symbols for faster execution */
-atom sym_t, sym_quote, sym_quasiquote, sym_unquote, sym_unquote_splicing, sym_assign, sym_fn, sym_if, sym_mac, sym_apply, sym_cons, sym_sym, sym_string, sym_num, sym__, sym_o, sym_table, sym_int, sym_char, sym_do;
-atom cur_expr;
-atom thrown;
+#define SCHED_SLICE 1000 /* evaluation steps a thread runs before it is preempted */
+
+#ifdef _MSC_VER
+static __declspec(thread) struct arc_context *ctx;
+#else
+static __thread struct arc_context *ctx; /* current context of this thread */
+#endif
+
+/* counters of vm-stats, when built with -DARC_STATS */
+#ifdef ARC_STATS
+#define VM_STAT(field) (ctx->vm_stats.field++)
+#else
+#define VM_STAT(field)
+#endif
 
 /* Be sure to free after use */
-void vector_new(struct vector *a) {
+void vector_new(struct arc_vector *a) {
 	a->capacity = sizeof(a->static_data) / sizeof(a->static_data[0]);
 	a->size = 0;
 	a->data = a->static_data;
 }
 
-void vector_add(struct vector *a, atom item) {
+void vector_add(struct arc_vector *a, atom item) {
 	if (a->size + 1 > a->capacity) {
 		a->capacity *= 2;
 		if (a->data == a->static_data) {
+#ifdef ARC_STATS
+			if (ctx) VM_STAT(vector_spills);
+#endif
 			a->data = malloc(a->capacity * sizeof(atom));
 			memcpy(a->data, a->static_data, a->size * sizeof(atom));
 		}
@@ -42,25 +58,128 @@ void vector_add(struct vector *a, atom item) {
 	a->size++;
 }
 
-void vector_clear(struct vector *a) {
+void vector_clear(struct arc_vector *a) {
 	a->size = 0;
 }
 
-void vector_free(struct vector *a) {
+void vector_free(struct arc_vector *a) {
 	if (a->data != a->static_data) free(a->data);
 }
 
-atom vector_to_atom(struct vector *a, int start) {
-	atom r = nil;
-	int i;
-	for (i = a->size - 1; i >= start; i--) {
-		r = cons(a->data[i], r);
+static void ptr_map_new(struct ptr_map *m) {
+	m->size = 0;
+	m->capacity = 64;
+	m->keys = calloc(m->capacity, sizeof(void *));
+	m->values = malloc(m->capacity * sizeof(atom));
+}
+
+static void ptr_map_free(struct ptr_map *m) {
+	free(m->keys);
+	free(m->values);
+}
+
+static atom *ptr_map_get(struct ptr_map *m, void *k) {
+	size_t i = ((size_t)k >> 4) & (m->capacity - 1);
+	while (m->keys[i]) {
+		if (m->keys[i] == k) return &m->values[i];
+		i = (i + 1) & (m->capacity - 1);
 	}
-	return r;
+	return NULL;
+}
+
+static void ptr_map_put(struct ptr_map *m, void *k, atom v) {
+	size_t i;
+	if (2 * (m->size + 1) > m->capacity) {
+		struct ptr_map old = *m;
+		m->capacity *= 2;
+		m->size = 0;
+		m->keys = calloc(m->capacity, sizeof(void *));
+		m->values = malloc(m->capacity * sizeof(atom));
+		for (i = 0; i < old.capacity; i++) {
+			if (old.keys[i]) ptr_map_put(m, old.keys[i], old.values[i]);
+		}
+		ptr_map_free(&old);
+	}
+	i = ((size_t)k >> 4) & (m->capacity - 1);
+	while (m->keys[i]) {
+		i = (i + 1) & (m->capacity - 1);
+	}
+	m->keys[i] = k;
+	m->values[i] = v;
+	m->size++;
+}
+
+/* Drops the entries of m whose keys are pairs the gc did not mark */
+static void ptr_map_prune(struct ptr_map *m) {
+	struct ptr_map old = *m;
+	size_t i;
+	if (m->size == 0) return;
+	ptr_map_new(m);
+	for (i = 0; i < old.capacity; i++) {
+		if (old.keys[i] && ((struct arc_pair *)old.keys[i])->mark)
+			ptr_map_put(m, old.keys[i], old.values[i]);
+	}
+	ptr_map_free(&old);
+}
+
+/* Returns the pair that all closures made by one fn form share: the
+ * forms of the body, or the one form, or else the parameter list. Returns
+ * the closure itself if none of those is a pair. */
+static void *closure_key(atom fn) {
+	atom params = car(cdr(fn)), body = cdr(cdr(fn));
+	if (body.type == T_CONS) {
+		/* make_closure wraps several forms in a new (do ...) */
+		if (car(body).type == T_SYM && car(body).value.symbol == ctx->sym_do.value.symbol && cdr(body).type == T_CONS)
+			return cdr(body).value.pair;
+		return body.value.pair;
+	}
+	if (params.type == T_CONS) return params.value.pair;
+	return fn.value.pair;
+}
+
+/* Returns the source location of a form or closure, or 0 if unknown */
+static double src_loc(atom a) {
+	atom *loc;
+	if (a.type == T_CLOSURE) loc = ptr_map_get(&ctx->fn_locs, closure_key(a));
+	else if (a.type == T_CONS) loc = ptr_map_get(&ctx->src_locs, a.value.pair);
+	else return 0;
+	return loc ? loc->value.number : 0;
+}
+
+/* Gives form to the location of form from, unless it has one */
+static void src_loc_copy(atom from, atom to) {
+	double loc;
+	if (!ctx->locations || to.type != T_CONS || ctx->src_locs.size == 0) return;
+	if ((loc = src_loc(from)) && !src_loc(to))
+		ptr_map_put(&ctx->src_locs, to.value.pair, make_number(loc));
+}
+
+/* Records where the fn form that made closure fn is, once per form */
+static void src_loc_closure(atom form, atom fn) {
+	void *key;
+	double loc;
+	if (!ctx->locations || ctx->src_locs.size == 0) return;
+	key = closure_key(fn);
+	if (!ptr_map_get(&ctx->fn_locs, key) && (loc = src_loc(form)))
+		ptr_map_put(&ctx->fn_locs, key, make_number(loc));
+}
+
+/* Writes loc as file:line */
+static void src_loc_format(double loc, char *buf, size_t size) {
+	size_t file = (size_t)(loc / 4294967296.0);
+	snprintf(buf, size, "%s:%ld", ctx->src_files[file], (long)(loc - file * 4294967296.0));
+}
+
+/* Line of p in the text being loaded. Calls go forward through the text. */
+static long src_line_at(const char *p) {
+	for (; ctx->src_pos < p; ctx->src_pos++) {
+		if (*ctx->src_pos == '\n') ctx->src_line++;
+	}
+	return ctx->src_line;
 }
 
 /* Be sure to free after use */
-void atom_to_vector(atom a, struct vector *v) {
+void atom_to_vector(atom a, struct arc_vector *v) {
 	vector_new(v);
 	for (; !no(a); a = cdr(a)) {
 		vector_add(v, car(a));
@@ -74,53 +193,82 @@ void stack_add(atom a) {
 	case T_MACRO:
 	case T_STRING:
 	case T_TABLE:
+	case T_CONTINUATION:
+	case T_THREAD:
+	case T_INPUT:
+	case T_INPUT_PIPE:
+	case T_OUTPUT:
 		break;
 	default:
 		return;
 	}
-	stack_size++;
-	if (stack_size > stack_capacity) {
-		stack_capacity = stack_size * 2;
-		stack = realloc(stack, stack_capacity * sizeof(atom));
+	ctx->stack_size++;
+	if (ctx->stack_size > ctx->stack_capacity) {
+		ctx->stack_capacity = ctx->stack_size * 2;
+		ctx->stack = realloc(ctx->stack, ctx->stack_capacity * sizeof(atom));
 	}
-	stack[stack_size - 1] = a;
+	ctx->stack[ctx->stack_size - 1] = a;
 }
 
 void stack_restore(int saved_size) {
-	stack_size = saved_size;
+	ctx->stack_size = saved_size;
 	/* if there is waste of memory, realloc */
-	if (stack_size < stack_capacity / 4) {
-		stack_capacity = stack_size * 2;
-		stack = realloc(stack, stack_capacity * sizeof(atom));
+	if (ctx->stack_size < ctx->stack_capacity / 4) {
+		ctx->stack_capacity = ctx->stack_size * 2;
+		ctx->stack = realloc(ctx->stack, ctx->stack_capacity * sizeof(atom));
 	}
 }
 
 void stack_restore_add(int saved_size, atom a) {
-	stack_size = saved_size;
+	ctx->stack_size = saved_size;
 	/* if there is waste of memory, realloc */
-	if (stack_size < stack_capacity / 4) {
-		stack_capacity = stack_size * 2;
-		stack = realloc(stack, stack_capacity * sizeof(atom));
+	if (ctx->stack_size < ctx->stack_capacity / 4) {
+		ctx->stack_capacity = ctx->stack_size * 2;
+		ctx->stack = realloc(ctx->stack, ctx->stack_capacity * sizeof(atom));
 	}
 	stack_add(a);
 }
 
 void consider_gc() {
-	if (alloc_count > 2 * alloc_count_old)
+	if (ctx->alloc_count > 2 * ctx->alloc_count_old)
 		gc();
 }
 
+/* Charges a sampled allocation of an object of the given size, and the
+ * ones skipped since the last sample, to the form being evaluated */
+static void alloc_record(size_t bytes) {
+	atom *i, form = ctx->cur_expr;
+	void *key = form.type == T_CONS ? (void *)form.value.pair : (void *)&ctx->alloc_sites; /* outside forms */
+	struct alloc_site *site;
+	ctx->alloc_countdown = ctx->alloc_sample;
+	if ((i = ptr_map_get(&ctx->alloc_index, key)))
+		site = &ctx->alloc_sites[(size_t)i->value.number];
+	else {
+		if (ctx->alloc_site_count == ctx->alloc_site_capacity) {
+			ctx->alloc_site_capacity = ctx->alloc_site_capacity ? ctx->alloc_site_capacity * 2 : 64;
+			ctx->alloc_sites = realloc(ctx->alloc_sites, ctx->alloc_site_capacity * sizeof(struct alloc_site));
+		}
+		ptr_map_put(&ctx->alloc_index, key, make_number((double)ctx->alloc_site_count));
+		site = &ctx->alloc_sites[ctx->alloc_site_count++];
+		site->form = form.type == T_CONS ? form : nil;
+		site->objects = site->bytes = 0;
+	}
+	site->objects += ctx->alloc_sample;
+	site->bytes += (double)ctx->alloc_sample * bytes;
+}
+
 atom cons(atom car_val, atom cdr_val)
 {
-	struct pair *a;
+	struct arc_pair *a;
 	atom p;
 
-	alloc_count++;
+	ctx->alloc_count++;
+	if (ctx->alloc_sample && --ctx->alloc_countdown == 0) alloc_record(sizeof(struct arc_pair));
 
-	a = malloc(sizeof(struct pair));
+	a = malloc(sizeof(struct arc_pair));
 	a->mark = 0;
-	a->next = pair_head;
-	pair_head = a;
+	a->next = ctx->pair_head;
+	ctx->pair_head = a;
 
 	p.type = T_CONS;
 	p.value.pair = a;
@@ -133,63 +281,280 @@ atom cons(atom car_val, atom cdr_val)
 	return p;
 }
 
+/* Marks everything reachable from root. Pending objects are kept on an
+ * explicit stack so deeply nested data cannot overflow the C stack. */
 void gc_mark(atom root)
 {
-	struct pair *a;
-	struct str *as;
-	struct table *at;
-start:
-	switch (root.type) {
+	struct arc_vector pending;
+	vector_new(&pending);
+	vector_add(&pending, root);
+	while (pending.size > 0) {
+		root = pending.data[--pending.size];
+		for (;;) {
+			switch (root.type) {
+			case T_CONS:
+			case T_CLOSURE:
+			case T_MACRO: {
+				struct arc_pair *a = root.value.pair;
+				if (a->mark) break;
+				a->mark = 1;
+				if (!no(car(root)))
+					vector_add(&pending, car(root));
+				root = cdr(root);
+				continue; }
+			case T_STRING:
+				root.value.str->mark = 1;
+				break;
+			case T_CONTINUATION: {
+				struct arc_continuation *k = root.value.cont;
+				if (k->mark) break;
+				k->mark = 1;
+				size_t i;
+				for (i = 0; i < k->frame_size; i++) {
+					vector_add(&pending, k->frames[i].expr);
+					vector_add(&pending, k->frames[i].env);
+					vector_add(&pending, k->frames[i].args);
+				}
+				for (i = 0; i < k->value_size; i++) {
+					vector_add(&pending, k->values[i]);
+				}
+				break; }
+			case T_THREAD: {
+				struct arc_thread *t = root.value.thread;
+				if (t->mark) break;
+				t->mark = 1;
+				if (t->dead) break;
+				vector_add(&pending, t->expr);
+				vector_add(&pending, t->env);
+				vector_add(&pending, t->val);
+				if (t == ctx->cur_thread) break; /* its stack is es */
+				size_t i;
+				for (i = 0; i < t->es.frame_size; i++) {
+					vector_add(&pending, t->es.frames[i].expr);
+					vector_add(&pending, t->es.frames[i].env);
+					vector_add(&pending, t->es.frames[i].args);
+				}
+				for (i = 0; i < t->es.value_size; i++) {
+					vector_add(&pending, t->es.values[i]);
+				}
+				break; }
+			case T_TABLE: {
+				struct arc_table *at = root.value.table;
+				if (at->mark) break;
+				at->mark = 1;
+				if (at->kind == TABLE_WEAK) { /* see gc_weak_tables */
+					vector_add(&ctx->weak_tables, root);
+					break;
+				}
+				size_t i;
+				for (i = 0; i < at->capacity; i++) {
+					struct table_entry *e;
+					for (e = at->data[i]; e; e = e->next) {
+						vector_add(&pending, e->k);
+						vector_add(&pending, e->v);
+					}
+				}
+				break; }
+			case T_INPUT:
+			case T_INPUT_PIPE:
+			case T_OUTPUT:
+				root.value.port->mark = 1;
+				root = root.value.port->s;
+				continue;
+			default:
+				break;
+			}
+			break;
+		}
+	}
+	vector_free(&pending);
+}
+
+/* Returns 1 if a is marked or is not collected */
+static int gc_marked(atom a) {
+	switch (a.type) {
 	case T_CONS:
 	case T_CLOSURE:
-	case T_MACRO:
-		a = root.value.pair;
-		if (a->mark) return;
-		a->mark = 1;
-		gc_mark(car(root));
-		/* reduce recursion */
-		root = cdr(root);
-		goto start;
-		break;
-	case T_STRING:
-		as = root.value.str;
-		if (as->mark) return;
-		as->mark = 1;
-		break;
-	case T_TABLE: {
-		at = root.value.table;
-		if (at->mark) return;
-		at->mark = 1;
-		size_t i;
-		for (i = 0; i < at->capacity; i++) {
-			struct table_entry *e = at->data[i];
-			while (e) {
-				gc_mark(e->k);
-				gc_mark(e->v);
-				e = e->next;
+	case T_MACRO: return a.value.pair->mark;
+	case T_STRING: return a.value.str->mark;
+	case T_TABLE: return a.value.table->mark;
+	case T_CONTINUATION: return a.value.cont->mark;
+	case T_THREAD: return a.value.thread->mark;
+	case T_INPUT:
+	case T_INPUT_PIPE:
+	case T_OUTPUT: return a.value.port->mark;
+	default: return 1;
+	}
+}
+
+/* A weak table keeps a value alive only while its key is reachable from
+ * elsewhere. Marks such values until no more are found, which may find
+ * more weak tables, then drops the entries whose keys were not marked. */
+static void gc_weak_tables() {
+	size_t i, j;
+	int found;
+	do {
+		found = 0;
+		for (i = 0; i < ctx->weak_tables.size; i++) {
+			struct arc_table *t = ctx->weak_tables.data[i].value.table;
+			for (j = 0; j < t->capacity; j++) {
+				struct table_entry *e;
+				for (e = t->data[j]; e; e = e->next) {
+					if (gc_marked(e->k) && !gc_marked(e->v)) {
+						gc_mark(e->v);
+						found = 1;
+					}
+				}
 			}
 		}
-		break; }
-	default:
-		return;
+	} while (found);
+	for (i = 0; i < ctx->weak_tables.size; i++) {
+		struct arc_table *t = ctx->weak_tables.data[i].value.table;
+		for (j = 0; j < t->capacity; j++) {
+			struct table_entry **p = &t->data[j];
+			while (*p) {
+				struct table_entry *e = *p;
+				if (gc_marked(e->k)) {
+					p = &e->next;
+					continue;
+				}
+				*p = e->next;
+				free(e);
+				t->size--;
+			}
+		}
+	}
+	vector_clear(&ctx->weak_tables);
+}
+
+static int port_std(struct arc_port *p) {
+	return p->fp == stdin || p->fp == stdout || p->fp == stderr;
+}
+
+/* Closes p and lets go what it held on to. The child process of the last
+ * port to it is waited for; if wait is 0, it is only reaped once it has
+ * exited, by this or a later gc. */
+static void port_close(struct arc_port *p, int wait) {
+	struct arc_port *q;
+	if (!p->fp) return;
+	if (p->popened) pclose(p->fp);
+	else fclose(p->fp);
+	p->fp = NULL;
+	free(p->buf);
+	p->buf = NULL;
+	p->s = nil;
+	if (!port_std(p) && !p->borrowed) ctx->open_ports--;
+#ifndef _WIN32
+	if (p->pid == 0) return;
+	for (q = ctx->port_head; q; q = q->next) {
+		if (q->fp && q->pid == p->pid) return;
+	}
+	if (wait) waitpid(p->pid, NULL, 0);
+	else if (waitpid(p->pid, NULL, WNOHANG) == 0) {
+		if (ctx->reap_count == ctx->reap_capacity) {
+			ctx->reap_capacity = ctx->reap_capacity ? ctx->reap_capacity * 2 : 8;
+			ctx->reap_pids = realloc(ctx->reap_pids, ctx->reap_capacity * sizeof(int));
+		}
+		ctx->reap_pids[ctx->reap_count++] = p->pid;
 	}
+#else
+	(void)q;
+	(void)wait;
+#endif
+}
+
+/* Reaps the children of collected ports that have exited since */
+static void port_reap() {
+#ifndef _WIN32
+	size_t i = 0;
+	while (i < ctx->reap_count) {
+		if (waitpid(ctx->reap_pids[i], NULL, WNOHANG) != 0)
+			ctx->reap_pids[i] = ctx->reap_pids[--ctx->reap_count];
+		else i++;
+	}
+#endif
 }
 
 void gc()
 {
-	struct pair *a, **p;
-	struct str *as, **ps;
-	struct table *at, **pt;
-
+	struct gc_stats *st = &ctx->gc_stats;
+	double start = now_seconds(), pause;
 	/* mark atoms in the stack */
 	size_t i;
-	for (i = 0; i < stack_size; i++) {
-		gc_mark(stack[i]);
+	for (i = 0; i < ctx->stack_size; i++) {
+		gc_mark(ctx->stack[i]);
+	}
+
+	/* mark the evaluator's pending frames and operands */
+	for (i = 0; i < ctx->es.frame_size; i++) {
+		gc_mark(ctx->es.frames[i].expr);
+		gc_mark(ctx->es.frames[i].env);
+		gc_mark(ctx->es.frames[i].args);
+	}
+	for (i = 0; i < ctx->es.value_size; i++) {
+		gc_mark(ctx->es.values[i]);
+	}
+
+	/* mark the suspended threads */
+	for (i = 0; i < ctx->thread_count; i++) {
+		atom t;
+		t.type = T_THREAD;
+		t.value.thread = ctx->threads[i];
+		gc_mark(t);
+	}
+	gc_mark(ctx->initial_globals);
+	for (i = 0; i < ctx->alloc_site_count; i++)
+		gc_mark(ctx->alloc_sites[i].form); /* keeps the addresses of the forms unique */
+	gc_weak_tables();
+
+	/* closure_names, src_locs and fn_locs do not keep their keys alive */
+	ptr_map_prune(&ctx->closure_names);
+	ptr_map_prune(&ctx->src_locs);
+	ptr_map_prune(&ctx->fn_locs);
+
+	st->allocated += ctx->alloc_count - ctx->alloc_count_old;
+	gc_sweep();
+	port_reap();
+	pause = now_seconds() - start;
+	st->collections++;
+	st->pause_total += pause;
+	if (pause > st->pause_max) st->pause_max = pause;
+	if (ctx->gc_trace)
+		fprintf(stderr, "gc %lu: %.3f ms, live %zu pairs, %zu strings (%zu bytes), %zu tables (%zu bytes)\n",
+			st->collections, pause * 1e3, st->pairs, st->strings, st->string_bytes, st->tables, st->table_bytes);
+}
+
+/* Frees every unmarked object and clears the marks of the others */
+void gc_sweep()
+{
+	struct arc_pair *a, **p;
+	struct arc_str *as, **ps;
+	struct arc_table *at, **pt;
+
+	struct gc_stats *st = &ctx->gc_stats;
+
+	ctx->alloc_count_old = 0;
+	st->pairs = st->strings = st->tables = 0;
+	st->string_bytes = st->table_bytes = 0;
+
+	/* Close and free unreachable ports, except the standard streams */
+	struct arc_port *po, **ppo = &ctx->port_head;
+	while (*ppo != NULL) {
+		po = *ppo;
+		if (!po->mark) {
+			*ppo = po->next;
+			if (!po->borrowed && !port_std(po)) port_close(po, 0);
+			free(po);
+		}
+		else {
+			ppo = &po->next;
+			po->mark = 0;
+			ctx->alloc_count_old++;
+		}
 	}
 
-	alloc_count_old = 0;
 	/* Free unmarked "cons" allocations */
-	p = &pair_head;
+	p = &ctx->pair_head;
 	while (*p != NULL) {
 		a = *p;
 		if (!a->mark) {
@@ -199,28 +564,35 @@ void gc()
 		else {
 			p = &a->next;
 			a->mark = 0; /* clear mark */
-			alloc_count_old++;
+			ctx->alloc_count_old++;
+			st->pairs++;
 		}
 	}
 
 	/* Free unmarked "string" allocations */
-	ps = &str_head;
+	ps = &ctx->str_head;
 	while (*ps != NULL) {
 		as = *ps;
 		if (!as->mark) {
 			*ps = as->next;
+#ifndef _WIN32
+			if (as->mapped) munmap(as->value, as->len + 1);
+			else
+#endif
 			free(as->value);
 			free(as);
 		}
 		else {
 			ps = &as->next;
 			as->mark = 0; /* clear mark */
-			alloc_count_old++;
+			ctx->alloc_count_old++;
+			st->strings++;
+			st->string_bytes += sizeof(struct arc_str) + (as->mapped ? 0 : as->len + 1);
 		}
 	}
 
 	/* Free unmarked "table" allocations */
-	pt = &table_head;
+	pt = &ctx->table_head;
 	while (*pt != NULL) {
 		at = *pt;
 		if (!at->mark) {
@@ -240,10 +612,47 @@ void gc()
 		else {
 			pt = &at->next;
 			at->mark = 0; /* clear mark */
-			alloc_count_old++;
+			ctx->alloc_count_old++;
+			st->tables++;
+			st->table_bytes += at->kind == TABLE_CACHE
+				? sizeof(struct cache_table) + at->capacity * sizeof(struct table_entry *) + at->size * sizeof(struct lru_entry)
+				: sizeof(struct arc_table) + at->capacity * sizeof(struct table_entry *) + at->size * sizeof(struct table_entry);
+		}
+	}
+
+	/* Free unmarked continuations */
+	struct arc_continuation *k, **pk = &ctx->cont_head;
+	while (*pk != NULL) {
+		k = *pk;
+		if (!k->mark) {
+			*pk = k->next;
+			free(k->frames);
+			free(k->values);
+			free(k);
+		}
+		else {
+			pk = &k->next;
+			k->mark = 0; /* clear mark */
+			ctx->alloc_count_old++;
+		}
+	}
+
+	/* Free unmarked threads, which have all finished */
+	struct arc_thread *th, **pth = &ctx->thread_head;
+	while (*pth != NULL) {
+		th = *pth;
+		if (!th->mark) {
+			*pth = th->next;
+			free(th);
+		}
+		else {
+			pth = &th->next;
+			th->mark = 0; /* clear mark */
+			ctx->alloc_count_old++;
 		}
 	}
-	alloc_count = alloc_count_old;
+	ctx->main_thread.mark = 0; /* part of ctx, not on thread_head */
+	ctx->alloc_count = ctx->alloc_count_old;
 }
 
 
@@ -255,32 +664,58 @@ atom make_number(double x)
 	return a;
 }
 
-atom make_sym(const char *s)
+static size_t symbol_hash(const char *s, size_t len) {
+	size_t h = 2166136261u, i; /* FNV-1a */
+	for (i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+/* Interns the symbol s[0..len) in the open addressing symbol_table */
+atom make_sym_len(const char *s, size_t len)
 {
 	atom a;
+	size_t mask = ctx->symbol_capacity - 1, i;
+	char *name;
 
-	int i;
-	for (i = symbol_size - 1; i >= 0; i--) { /* compare recent symbol first */
-		char *s2 = symbol_table[i];
-		if (strcmp(s2, s) == 0) {
-			a.type = T_SYM;
-			a.value.symbol = s2;
+	a.type = T_SYM;
+	for (i = symbol_hash(s, len) & mask; (name = ctx->symbol_table[i]); i = (i + 1) & mask) {
+		if (strncmp(name, s, len) == 0 && name[len] == 0) {
+			a.value.symbol = name;
 			return a;
 		}
 	}
 
-	a.type = T_SYM;
-	a.value.symbol = (char*)strdup(s);
-	if (symbol_size >= symbol_capacity) {
-		symbol_capacity *= 2;
-		symbol_table = realloc(symbol_table, symbol_capacity * sizeof(char *));
+	if (2 * (ctx->symbol_size + 1) > ctx->symbol_capacity) {
+		char **old = ctx->symbol_table;
+		size_t j, old_capacity = ctx->symbol_capacity;
+		ctx->symbol_capacity *= 2;
+		mask = ctx->symbol_capacity - 1;
+		ctx->symbol_table = calloc(ctx->symbol_capacity, sizeof(char *));
+		for (j = 0; j < old_capacity; j++) {
+			if (!old[j]) continue;
+			for (i = symbol_hash(old[j], strlen(old[j])) & mask; ctx->symbol_table[i]; i = (i + 1) & mask) {
+			}
+			ctx->symbol_table[i] = old[j];
+		}
+		free(old);
+		for (i = symbol_hash(s, len) & mask; ctx->symbol_table[i]; i = (i + 1) & mask) {
+		}
 	}
-	symbol_table[symbol_size] = a.value.symbol;
-	symbol_size++;
+	name = malloc(len + 1);
+	memcpy(name, s, len);
+	name[len] = 0;
+	ctx->symbol_table[i] = name;
+	ctx->symbol_size++;
+	a.value.symbol = name;
 	return a;
 }
 
-atom make_builtin(builtin fn)
+atom make_sym(const char *s)
+{
+	return make_sym_len(s, strlen(s));
+}
+
+atom make_builtin(arc_builtin fn)
 {
 	atom a;
 	a.type = T_BUILTIN;
@@ -313,7 +748,7 @@ error make_closure(atom env, atom args, atom body, atom *result)
 		p = car(body);
 	}
 	else {
-		p = cons(sym_do, body);
+		p = cons(ctx->sym_do, body);
 	}
 	*result = cons(env, cons(args, p));
 	result->type = T_CLOSURE;
@@ -322,40 +757,70 @@ error make_closure(atom env, atom args, atom body, atom *result)
 }
 
 atom make_string(char *x)
+{
+	return make_string_len(x, strlen(x));
+}
+
+/* x holds len bytes and a 0 after them */
+atom make_string_len(char *x, size_t len)
 {
 	atom a;
-	struct str *s;
-	alloc_count++;
-	s = a.value.str = malloc(sizeof(struct str));
+	struct arc_str *s;
+	ctx->alloc_count++;
+	if (ctx->alloc_sample && --ctx->alloc_countdown == 0) alloc_record(sizeof(struct arc_str) + len + 1);
+	s = a.value.str = malloc(sizeof(struct arc_str));
 	s->value = x;
+	s->len = len;
+	s->mapped = 0;
 	s->mark = 0;
-	s->next = str_head;
-	str_head = s;
+	s->next = ctx->str_head;
+	ctx->str_head = s;
 
 	a.type = T_STRING;
 	stack_add(a);
 	return a;
 }
 
-atom make_input(FILE *fp) {
+/* type is T_INPUT, T_INPUT_PIPE or T_OUTPUT */
+static atom make_port(int type, FILE *fp) {
 	atom a;
-	a.type = T_INPUT;
-	a.value.fp = fp;
+	struct arc_port *p = malloc(sizeof(struct arc_port));
+	ctx->alloc_count++;
+	p->fp = fp;
+	p->s = nil;
+	p->buf = NULL;
+	p->pid = 0;
+	p->popened = type == T_INPUT_PIPE;
+	p->borrowed = 0;
+	p->mark = 0;
+	p->next = ctx->port_head;
+	ctx->port_head = p;
+	if (!port_std(p)) ctx->open_ports++;
+	a.type = type;
+	a.value.port = p;
+	stack_add(a);
 	return a;
 }
 
+atom make_input(FILE *fp) {
+	return make_port(T_INPUT, fp);
+}
+
 atom make_input_pipe(FILE *fp) {
-	atom a;
-	a.type = T_INPUT_PIPE;
-	a.value.fp = fp;
-	return a;
+	return make_port(T_INPUT_PIPE, fp);
 }
 
 atom make_output(FILE *fp) {
-	atom a;
-	a.type = T_OUTPUT;
-	a.value.fp = fp;
-	return a;
+	return make_port(T_OUTPUT, fp);
+}
+
+/* Gives the stream of a, which must be an input port if input is 1 and an
+ * output port otherwise, and not closed */
+static error port_fp(atom a, int input, FILE **fp) {
+	if (input ? a.type != T_INPUT && a.type != T_INPUT_PIPE : a.type != T_OUTPUT) return ERROR_TYPE;
+	if (!a.value.port->fp) return ERROR_FILE;
+	*fp = a.value.port->fp;
+	return ERROR_OK;
 }
 
 atom make_char(char c) {
@@ -365,27 +830,41 @@ atom make_char(char c) {
 	return a;
 }
 
+/* writes the printed representation of a to fp, 0 bytes included */
+void print_fp(atom a, int write, FILE *fp)
+{
+	struct string s;
+	string_new(&s);
+	to_string_cat(&s, a, write);
+	fwrite(s.str, 1, s.len, fp);
+	free(s.str);
+}
+
 void print_expr(atom a)
 {
-	char *s = to_string(a, 1);
-	printf("%s", s);
-	free(s);
+	print_fp(a, 1, stdout);
 }
 
 void pr(atom a)
 {
-	char *s = to_string(a, 0);
-	printf("%s", s);
-	free(s);
+	print_fp(a, 0, stdout);
+}
+
+/* characters that end a token */
+static int is_delim(char c) {
+	switch (c) {
+	case '(': case ')': case '[': case ']': case ';':
+	case ' ': case '\t': case '\r': case '\n': case '\0':
+		return 1;
+	default:
+		return 0;
+	}
 }
 
 error lex(const char *str, const char **start, const char **end)
 {
-	const char *ws = " \t\r\n";
-	const char *delim = "()[] \t\r\n;";
-	const char *prefix = "()[]'`";
 start:
-	str += strspn(str, ws);
+	while (*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n') str++;
 
 	if (str[0] == '\0') {
 		*start = *end = NULL;
@@ -394,11 +873,14 @@ start:
 
 	*start = str;
 
-	if (strchr(prefix, str[0]) != NULL)
+	switch (str[0]) {
+	case '(': case ')': case '[': case ']': case '\'': case '`':
 		*end = str + 1;
-	else if (str[0] == ',')
+		break;
+	case ',':
 		*end = str + (str[1] == '@' ? 2 : 1);
-	else if (str[0] == '"') {
+		break;
+	case '"':
 		str++;
 		while (1) {
 			if (*str == 0) return ERROR_FILE; /* string not terminated */
@@ -409,32 +891,70 @@ start:
 			str++;
 		}
 		*end = str + 1;
-	}
-	else if (str[0] == ';') { /* end-of-line comment */
-		str += strcspn(str, "\n");
+		break;
+	case ';': /* end-of-line comment */
+		while (*str && *str != '\n') str++;
 		goto start;
+	default:
+		while (!is_delim(*str)) str++;
+		*end = str;
 	}
-	else
-		*end = str + strcspn(str, delim);
 
 	return ERROR_OK;
 }
 
+/* Reads a decimal number, [+-]digits[.digits][(e|E)[+-]digits] with a digit
+ * before or after the point. Returns 0 if [start, end) is not one. */
+static int scan_number(const char *start, const char *end, double *result) {
+	const char *p = start;
+	double v = 0;
+	int digits = 0, exact = 1;
+	if (p < end && (*p == '+' || *p == '-')) p++;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		v = v * 10 + (*p - '0');
+	if (p < end && *p == '.') {
+		exact = 0;
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) digits++;
+	}
+	if (digits == 0) return 0;
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *e;
+		exact = 0;
+		if (++p < end && (*p == '+' || *p == '-')) p++;
+		for (e = p; p < end && *p >= '0' && *p <= '9'; p++) {
+		}
+		if (p == e) return 0;
+	}
+	if (p != end) return 0;
+	if (exact && digits <= 15) /* v is exact */
+		*result = *start == '-' ? -v : v;
+	else { /* let strtod round it */
+		char buf[64], *s = end - start < (long)sizeof(buf) ? buf : malloc(end - start + 1);
+		memcpy(s, start, end - start);
+		s[end - start] = 0;
+		*result = strtod(s, NULL);
+		if (s != buf) free(s);
+	}
+	return 1;
+}
+
+/* whether [start, end) is s */
+static int slice_is(const char *start, const char *end, const char *s) {
+	size_t n = strlen(s);
+	return (size_t)(end - start) == n && memcmp(start, s, n) == 0;
+}
+
 error parse_simple(const char *start, const char *end, atom *result)
 {
-	char *p;
+	double val;
+	long length = end - start, i;
 
-	/* Is it a number? */
-	double val = strtod(start, &p);
-	if (p == end) {
-		result->type = T_NUM;
-		result->value.number = val;
+	if (scan_number(start, end, &val)) {
+		*result = make_number(val);
 		return ERROR_OK;
 	}
 	else if (start[0] == '"') { /* "string" */
-		result->type = T_STRING;
-		size_t length = end - start - 2;
-		char *buf = (char*)malloc(length + 1);
+		char *buf = malloc(length - 1);
 		const char *ps = start + 1;
 		char *pt = buf;
 		while (ps < end - 1) {
@@ -462,133 +982,65 @@ error parse_simple(const char *start, const char *end, atom *result)
 			pt++;
 		}
 		*pt = 0;
-		buf = realloc(buf, pt - buf + 1);
 		*result = make_string(buf);
 		return ERROR_OK;
 	}
 	else if (start[0] == '#') { /* #\char */
-		char *buf = malloc(end - start + 1);
-		memcpy(buf, start, end - start);
-		buf[end - start] = 0;
-		size_t length = end - start;
-		if (length == 3 && buf[1] == '\\') { /* plain character e.g. #\a */
-			*result = make_char(buf[2]);
-			free(buf);
-			return ERROR_OK;
-		}
-		else {
-			char c;
-			if (strcmp(buf, "#\\nul") == 0)
-				c = '\0';
-			else if (strcmp(buf, "#\\return") == 0)
-				c = '\r';
-			else if (strcmp(buf, "#\\newline") == 0)
-				c = '\n';
-			else if (strcmp(buf, "#\\tab") == 0)
-				c = '\t';
-			else if (strcmp(buf, "#\\space") == 0)
-				c = ' ';
-			else {
-				free(buf);
-				return ERROR_SYNTAX;
-			}
-			free(buf);
-			*result = make_char(c);
-			return ERROR_OK;
-		}
+		char c;
+		if (length == 3 && start[1] == '\\') /* plain character e.g. #\a */
+			c = start[2];
+		else if (slice_is(start, end, "#\\nul"))
+			c = '\0';
+		else if (slice_is(start, end, "#\\return"))
+			c = '\r';
+		else if (slice_is(start, end, "#\\newline"))
+			c = '\n';
+		else if (slice_is(start, end, "#\\tab"))
+			c = '\t';
+		else if (slice_is(start, end, "#\\space"))
+			c = ' ';
+		else
+			return ERROR_SYNTAX;
+		*result = make_char(c);
+		return ERROR_OK;
 	}
 
 	/* NIL or symbol */
-	char *buf = malloc(end - start + 1);
-	memcpy(buf, start, end - start);
-	buf[end - start] = 0;
-
-	if (strcmp(buf, "nil") == 0)
+	if (slice_is(start, end, "nil")) {
 		*result = nil;
-	else if (strcmp(buf, ".") == 0)
-		*result = make_sym(buf);
-	else {
+		return ERROR_OK;
+	}
+	if (length == 1 && start[0] == '.') {
+		*result = make_sym_len(start, 1);
+		return ERROR_OK;
+	}
+	for (i = length - 1; i >= 0; i--) { /* left-associative */
+		char c = start[i];
 		atom a1, a2;
-		long length = end - start, i;
-		for (i = length - 1; i >= 0; i--) { /* left-associative */
-			if (buf[i] == '.') { /* a.b => (a b) */
-				if (i == 0 || i == length - 1) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				error err;
-				err = parse_simple(buf, buf + i, &a1);
-				if (err) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				err = parse_simple(buf + i + 1, buf + length, &a2);
-				if (err) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				free(buf);
-				*result = cons(a1, cons(a2, nil));
-				return ERROR_OK;
-			}
-			else if (buf[i] == '!') { /* a!b => (a 'b) */
-				if (i == 0 || i == length - 1) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				error err;
-				err = parse_simple(buf, buf + i, &a1);
-				if (err) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				err = parse_simple(buf + i + 1, buf + length, &a2);
-				if (err) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				free(buf);
-				*result = cons(a1, cons(cons(sym_quote, cons(a2, nil)), nil));
-				return ERROR_OK;
-			}
-			else if (buf[i] == ':') { /* a:b => (compose a b) */
-				if (i == 0 || i == length - 1) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				error err;
-				err = parse_simple(buf, buf + i, &a1);
-				if (err) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				err = parse_simple(buf + i + 1, buf + length, &a2);
-				if (err) {
-					free(buf);
-					return ERROR_SYNTAX;
-				}
-				free(buf);
-				*result = cons(make_sym("compose"), cons(a1, cons(a2, nil)));
-				return ERROR_OK;
-			}
-		}
-		if (length >= 2 && buf[0] == '~') { /* ~a => (complement a) */
-			atom a1;
-			error err = parse_simple(buf + 1, buf + length, &a1);
-			free(buf);
-			if (err) {
-				return ERROR_SYNTAX;
-			}
-			*result = cons(make_sym("complement"), cons(a1, nil));
-			return ERROR_OK;
-		}
-		*result = make_sym(buf);
+		if (c != '.' && c != '!' && c != ':') continue;
+		if (i == 0 || i == length - 1) return ERROR_SYNTAX;
+		if (parse_simple(start, start + i, &a1) || parse_simple(start + i + 1, end, &a2))
+			return ERROR_SYNTAX;
+		if (c == '.') /* a.b => (a b) */
+			*result = cons(a1, cons(a2, nil));
+		else if (c == '!') /* a!b => (a 'b) */
+			*result = cons(a1, cons(cons(ctx->sym_quote, cons(a2, nil)), nil));
+		else /* a:b => (compose a b) */
+			*result = cons(make_sym("compose"), cons(a1, cons(a2, nil)));
+		return ERROR_OK;
 	}
-
-	free(buf);
+	if (length >= 2 && start[0] == '~') { /* ~a => (complement a) */
+		atom a1;
+		if (parse_simple(start + 1, end, &a1)) return ERROR_SYNTAX;
+		*result = cons(make_sym("complement"), cons(a1, nil));
+		return ERROR_OK;
+	}
+	*result = make_sym_len(start, length);
 	return ERROR_OK;
 }
 
+static error read_token(const char *token, const char **end, atom *result);
+
 error read_list(const char *start, const char **end, atom *result)
 {
 	atom p;
@@ -626,7 +1078,7 @@ error read_list(const char *start, const char **end, atom *result)
 			return err;
 		}
 
-		err = read_expr(token, end, &item);
+		err = read_token(token, end, &item);
 		if (err)
 			return err;
 
@@ -651,10 +1103,10 @@ error read_bracket(const char *start, const char **end, atom *result)
 	p = *result = nil;
 
 	/* First item */
-	*result = cons(sym_fn, nil);
+	*result = cons(ctx->sym_fn, nil);
 	p = *result;
 
-	cdr(p) = cons(cons(sym__, nil), nil);
+	cdr(p) = cons(cons(ctx->sym__, nil), nil);
 	p = cdr(p);
 
 	atom body = nil;
@@ -670,7 +1122,7 @@ error read_bracket(const char *start, const char **end, atom *result)
 			return ERROR_OK;
 		}
 
-		err = read_expr(token, end, &item);
+		err = read_token(token, end, &item);
 		if (err) return err;
 
 		if (no(body)) {
@@ -693,28 +1145,38 @@ error read_expr(const char *input, const char **end, atom *result)
 	err = lex(input, &token, end);
 	if (err)
 		return err;
+	return read_token(token, end, result);
+}
 
-	if (token[0] == '(') {
-		return read_list(*end, end, result);
+/* Reads the expression that starts with token, which lex ended at *end */
+static error read_token(const char *token, const char **end, atom *result)
+{
+	if (token[0] == '(' || token[0] == '[') {
+		error err;
+		long line = ctx->src_file >= 0 ? src_line_at(token) : 0;
+		if (token[0] == '(')
+			err = read_list(*end, end, result);
+		else
+			err = read_bracket(*end, end, result);
+		if (!err && line && result->type == T_CONS)
+			ptr_map_put(&ctx->src_locs, result->value.pair, make_number(ctx->src_file * 4294967296.0 + line));
+		return err;
 	}
 	else if (token[0] == ')')
 		return ERROR_SYNTAX;
-	else if (token[0] == '[') {
-		return read_bracket(*end, end, result);
-	}
 	else if (token[0] == ']')
 		return ERROR_SYNTAX;
 	else if (token[0] == '\'') {
-		*result = cons(sym_quote, cons(nil, nil));
+		*result = cons(ctx->sym_quote, cons(nil, nil));
 		return read_expr(*end, end, &car(cdr(*result)));
 	}
 	else if (token[0] == '`') {
-		*result = cons(sym_quasiquote, cons(nil, nil));
+		*result = cons(ctx->sym_quasiquote, cons(nil, nil));
 		return read_expr(*end, end, &car(cdr(*result)));
 	}
 	else if (token[0] == ',') {
 		*result = cons(
-			token[1] == '@' ? sym_unquote_splicing : sym_unquote,
+			token[1] == '@' ? ctx->sym_unquote_splicing : ctx->sym_unquote,
 			cons(nil, nil));
 		return read_expr(*end, end, &car(cdr(*result)));
 	}
@@ -722,12 +1184,6 @@ error read_expr(const char *input, const char **end, atom *result)
 		return parse_simple(token, *end, result);
 }
 
-#ifndef READLINE
-char *readline(char *prompt) {
-	return readline_fp(prompt, stdin);
-}
-#endif /* READLINE */
-
 char *readline_fp(char *prompt, FILE *fp) {
 	size_t size = 80;
 	/* The size is extended by the input with the value of the provisional */
@@ -769,9 +1225,12 @@ atom env_create_cap(atom parent, size_t capacity)
 
 error env_get(atom env, char *symbol, atom *result)
 {
+	VM_STAT(env_gets);
 	while (1) {
-		struct table *ptbl = cdr(env).value.table;
-		struct table_entry *a = table_get_sym(ptbl, symbol);
+		struct arc_table *ptbl = cdr(env).value.table;
+		struct table_entry *a;
+		VM_STAT(env_scopes);
+		a = table_get_sym(ptbl, symbol);
 		if (a) {
 			*result = a->v;
 			return ERROR_OK;
@@ -785,7 +1244,7 @@ error env_get(atom env, char *symbol, atom *result)
 }
 
 error env_assign(atom env, char *symbol, atom value) {
-	struct table *ptbl = cdr(env).value.table;
+	struct arc_table *ptbl = cdr(env).value.table;
 	table_set_sym(ptbl, symbol, value);
 	return ERROR_OK;
 }
@@ -793,7 +1252,7 @@ error env_assign(atom env, char *symbol, atom value) {
 error env_assign_eq(atom env, char *symbol, atom value) {
 	while (1) {
 		atom parent = car(env);
-		struct table *ptbl = cdr(env).value.table;
+		struct arc_table *ptbl = cdr(env).value.table;
 		struct table_entry *a = table_get_sym(ptbl, symbol);
 		if (a) {
 			a->v = value;
@@ -854,11 +1313,11 @@ atom copy_list(atom list)
 }
 
 error destructuring_bind(atom arg_name, atom val, int val_unspecified, atom env) {
-	switch (arg_name.type) {
+	for (;;) switch (arg_name.type) {
 	case T_SYM:
 		return env_assign(env, arg_name.value.symbol, val);
 	case T_CONS:
-		if (is(car(arg_name), sym_o)) { /* (o ARG [DEFAULT]) */
+		if (is(car(arg_name), ctx->sym_o)) { /* (o ARG [DEFAULT]) */
 			if (val_unspecified) { /* missing argument */
 				if (!no(cdr(cdr(arg_name)))) {
 					error err = eval_expr(car(cdr(cdr(arg_name))), env, &val);
@@ -871,9 +1330,13 @@ error destructuring_bind(atom arg_name, atom val, int val_unspecified, atom env)
 			if (val.type != T_CONS) {
 				return ERROR_ARGS;
 			}
+			/* recurse only as deep as the pattern nests; walk its tail iteratively */
 			error err = destructuring_bind(car(arg_name), car(val), 0, env);
 			if (err) return err;
-			return destructuring_bind(cdr(arg_name), cdr(val), no(cdr(val)), env);
+			arg_name = cdr(arg_name);
+			val_unspecified = no(cdr(val));
+			val = cdr(val);
+			continue;
 		}
 	case T_NIL:
 		if (no(val))
@@ -885,20 +1348,30 @@ error destructuring_bind(atom arg_name, atom val, int val_unspecified, atom env)
 	}
 }
 
-error env_bind(atom env, atom arg_names, struct vector *vargs) {
-	/* Bind the arguments */
+/* Binds argv[0..argc) followed by the elements of the list tail to arg_names.
+ * A rest parameter receives the unconsumed arguments consed onto tail, so a
+ * spread list passed through apply is shared rather than copied. */
+error env_bind(atom env, atom arg_names, atom *argv, size_t argc, atom tail) {
 	size_t i = 0;
 	while (!no(arg_names)) {
 		if (arg_names.type == T_SYM) {
-			env_assign(env, arg_names.value.symbol, vector_to_atom(vargs, i));
-			i = vargs->size;
-			break;
+			atom rest = tail;
+			size_t j;
+			for (j = argc; j > i; j--) {
+				rest = cons(argv[j - 1], rest);
+			}
+			env_assign(env, arg_names.value.symbol, rest);
+			return ERROR_OK;
 		}
 		atom arg_name = car(arg_names);
 		atom val;
 		int val_unspecified = 0;
-		if (i < vargs->size) {
-			val = vargs->data[i];
+		if (i < argc) {
+			val = argv[i++];
+		}
+		else if (tail.type == T_CONS) {
+			val = car(tail);
+			tail = cdr(tail);
 		}
 		else {
 			val = nil;
@@ -909,44 +1382,27 @@ error env_bind(atom env, atom arg_names, struct vector *vargs) {
 			return err;
 		}
 		arg_names = cdr(arg_names);
-		i++;
 	}
-	if (i < vargs->size) {
+	if (i < argc || !no(tail)) {
 		return ERROR_ARGS;
 	}
 	return ERROR_OK;
 }
 
-error apply(atom fn, struct vector *vargs, atom *result)
+error apply(atom fn, struct arc_vector *vargs, atom *result)
 {
-	if (fn.type == T_BUILTIN)
+	if (fn.type == T_BUILTIN) {
+		ctx->yield_ok = 0; /* the caller is C code that cannot be resumed */
 		return (*fn.value.builtin)(vargs, result);
-	else if (fn.type == T_CLOSURE) {		
-		atom arg_names = car(cdr(fn));
-		atom env = env_create(car(fn));
-		atom body = cdr(cdr(fn));
-
-		error err = env_bind(env, arg_names, vargs);
-		if (err) {
-			return err;
-		}
-
-		/* Evaluate the body */
-		err = eval_expr(body, env, result);
-		if (err) {
-			return err;
-		}
-		return ERROR_OK;
-	}
-	else if (fn.type == T_CONTINUATION) {
-		if (vargs->size != 1) return ERROR_ARGS;
-		thrown = vargs->data[0];
-		longjmp(*fn.value.jb, 1);
 	}
+	else if (fn.type == T_CLOSURE || fn.type == T_CONTINUATION || fn.type == T_ESCAPE)
+		return eval_apply(fn, vargs->data, vargs->size, nil, result);
 	else if (fn.type == T_STRING) { /* implicit indexing for string */
 		if (vargs->size != 1) return ERROR_ARGS;
-		size_t index = (size_t)(vargs->data[0]).value.number;
-		*result = make_char(fn.value.str->value[index]);
+		if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+		double index = vargs->data[0].value.number;
+		if (!(index >= 0 && index < fn.value.str->len)) return ERROR_ARGS; /* a mapped string ends at its mapping */
+		*result = make_char(fn.value.str->value[(size_t)index]);
 		return ERROR_OK;
 	}
 	else if (fn.type == T_CONS && listp(fn)) { /* implicit indexing for list */
@@ -984,7 +1440,7 @@ error apply(atom fn, struct vector *vargs, atom *result)
 	}
 }
 
-error builtin_car(struct vector *vargs, atom *result)
+error builtin_car(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size != 1)
 		return ERROR_ARGS;
@@ -1000,7 +1456,7 @@ error builtin_car(struct vector *vargs, atom *result)
 	return ERROR_OK;
 }
 
-error builtin_cdr(struct vector *vargs, atom *result)
+error builtin_cdr(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size != 1)
 		return ERROR_ARGS;
@@ -1016,7 +1472,7 @@ error builtin_cdr(struct vector *vargs, atom *result)
 	return ERROR_OK;
 }
 
-error builtin_cons(struct vector *vargs, atom *result)
+error builtin_cons(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size != 2)
 		return ERROR_ARGS;
@@ -1046,7 +1502,7 @@ atom append(atom a, atom b) {
 + args
 Addition. This operator also performs string and list concatenation.
 */
-error builtin_add(struct vector *vargs, atom *result)
+error builtin_add(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size == 0) {
 		*result = make_number(0);
@@ -1066,11 +1522,9 @@ error builtin_add(struct vector *vargs, atom *result)
 			string_new(&buf);
 			size_t i;
 			for (i = 0; i < vargs->size; i++) {
-				char *s = to_string(vargs->data[i], 0);
-				string_cat(&buf, s);
-				free(s);
+				to_string_cat(&buf, vargs->data[i], 0);
 			}
-			*result = make_string(buf.str);
+			*result = make_string_len(buf.str, buf.len);
 		}
 		else if (vargs->data[0].type == T_CONS || vargs->data[0].type == T_NIL) {
 			atom acc = nil;
@@ -1084,7 +1538,7 @@ error builtin_add(struct vector *vargs, atom *result)
 	return ERROR_OK;
 }
 
-error builtin_subtract(struct vector *vargs, atom *result)
+error builtin_subtract(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size == 0) { /* 0 argument */
 		*result = make_number(0);
@@ -1105,7 +1559,7 @@ error builtin_subtract(struct vector *vargs, atom *result)
 	return ERROR_OK;
 }
 
-error builtin_multiply(struct vector *vargs, atom *result)
+error builtin_multiply(struct arc_vector *vargs, atom *result)
 {
 	double r = 1;
 	size_t i;
@@ -1117,7 +1571,7 @@ error builtin_multiply(struct vector *vargs, atom *result)
 	return ERROR_OK;
 }
 
-error builtin_divide(struct vector *vargs, atom *result)
+error builtin_divide(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size == 0) { /* 0 argument */
 		*result = make_number(1);
@@ -1138,10 +1592,17 @@ error builtin_divide(struct vector *vargs, atom *result)
 	return ERROR_OK;
 }
 
-error builtin_less(struct vector *vargs, atom *result)
+/* orders strings by their bytes, 0 bytes included; a prefix comes first */
+static int str_cmp(struct arc_str *a, struct arc_str *b) {
+	int c = memcmp(a->value, b->value, a->len < b->len ? a->len : b->len);
+	if (c) return c;
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+error builtin_less(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size <= 1) {
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	}
 	size_t i;
@@ -1153,26 +1614,26 @@ error builtin_less(struct vector *vargs, atom *result)
 				return ERROR_OK;
 			}
 		}
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	case T_STRING:
 		for (i = 0; i < vargs->size - 1; i++) {
-			if (strcmp(vargs->data[i].value.str->value, vargs->data[i + 1].value.str->value) >= 0) {
+			if (str_cmp(vargs->data[i].value.str, vargs->data[i + 1].value.str) >= 0) {
 				*result = nil;
 				return ERROR_OK;
 			}
 		}
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	default:
 		return ERROR_TYPE;
 	}
 }
 
-error builtin_greater(struct vector *vargs, atom *result)
+error builtin_greater(struct arc_vector *vargs, atom *result)
 {
 	if (vargs->size <= 1) {
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	}
 	size_t i;
@@ -1184,35 +1645,33 @@ error builtin_greater(struct vector *vargs, atom *result)
 				return ERROR_OK;
 			}
 		}
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	case T_STRING:
 		for (i = 0; i < vargs->size - 1; i++) {
-			if (strcmp(vargs->data[i].value.str->value, vargs->data[i + 1].value.str->value) <= 0) {
+			if (str_cmp(vargs->data[i].value.str, vargs->data[i + 1].value.str) <= 0) {
 				*result = nil;
 				return ERROR_OK;
 			}
 		}
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	default:
 		return ERROR_TYPE;
 	}
 }
 
-error builtin_apply(struct vector *vargs, atom *result)
+/* apply fn [arg ...] list
+ * The leading arguments are prepended to list. */
+error builtin_apply(struct arc_vector *vargs, atom *result)
 {
-	atom fn;
-
-	if (vargs->size != 2)
+	if (vargs->size < 2)
 		return ERROR_ARGS;
 
-	fn = vargs->data[0];
-	struct vector v;
-	atom_to_vector(vargs->data[1], &v);
-	error err = apply(fn, &v, result);
-	vector_free(&v);
-	return err;
+	atom tail = vargs->data[vargs->size - 1];
+	if (!listp(tail))
+		return ERROR_TYPE;
+	return eval_apply(vargs->data[0], vargs->data + 1, vargs->size - 2, tail, result);
 }
 
 int is(atom a, atom b) {
@@ -1231,7 +1690,8 @@ int is(atom a, atom b) {
 		case T_BUILTIN:
 			return (a.value.builtin == b.value.builtin);
 		case T_STRING:
-			return strcmp(a.value.str->value, b.value.str->value) == 0;
+			return a.value.str->len == b.value.str->len
+				&& memcmp(a.value.str->value, b.value.str->value, a.value.str->len) == 0;
 		case T_CHAR:
 			return (a.value.ch == b.value.ch);
 		case T_TABLE:
@@ -1239,33 +1699,51 @@ int is(atom a, atom b) {
 		case T_INPUT:
 		case T_INPUT_PIPE:
 		case T_OUTPUT:
-			return a.value.fp == b.value.fp;
+			return a.value.port == b.value.port;
 		case T_CONTINUATION:
-			return a.value.jb == b.value.jb;
+			return a.value.cont == b.value.cont;
+		case T_ESCAPE:
+			return a.value.serial == b.value.serial;
+		case T_THREAD:
+			return a.value.thread == b.value.thread;
 		}
 	}
 	return 0;
 }
 
 int iso(atom a, atom b) {
-	if (a.type == b.type) {
-		switch (a.type) {
-		case T_CONS:
-		case T_CLOSURE:
-		case T_MACRO:
-			return iso(a.value.pair->car, b.value.pair->car) && iso(a.value.pair->cdr, b.value.pair->cdr);
-		default:
-			return is(a, b);
+	struct arc_vector pending; /* (a b) pairs still to compare */
+	int r = 1;
+	vector_new(&pending);
+	for (;;) {
+		if (a.type != b.type) {
+			r = 0;
+			break;
+		}
+		if ((a.type == T_CONS || a.type == T_CLOSURE || a.type == T_MACRO) && a.value.pair != b.value.pair) {
+			vector_add(&pending, car(a));
+			vector_add(&pending, car(b));
+			a = cdr(a);
+			b = cdr(b);
+			continue;
+		}
+		if (a.type != T_CONS && a.type != T_CLOSURE && a.type != T_MACRO && !is(a, b)) {
+			r = 0;
+			break;
 		}
+		if (pending.size == 0) break;
+		b = pending.data[--pending.size];
+		a = pending.data[--pending.size];
 	}
-	return 0;
+	vector_free(&pending);
+	return r;
 }
 
-error builtin_is(struct vector *vargs, atom *result)
+error builtin_is(struct arc_vector *vargs, atom *result)
 {
 	atom a, b;
 	if (vargs->size <= 1) {
-		*result = sym_t;
+		*result = ctx->sym_t;
 		return ERROR_OK;
 	}
 	size_t i;
@@ -1277,11 +1755,11 @@ error builtin_is(struct vector *vargs, atom *result)
 			return ERROR_OK;
 		}
 	}
-	*result = sym_t;
+	*result = ctx->sym_t;
 	return ERROR_OK;
 }
 
-error builtin_scar(struct vector *vargs, atom *result) {
+error builtin_scar(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	atom place = vargs->data[0], value;
 	if (place.type != T_CONS) return ERROR_TYPE;
@@ -1291,7 +1769,7 @@ error builtin_scar(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_scdr(struct vector *vargs, atom *result) {
+error builtin_scdr(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	atom place = vargs->data[0], value;
 	if (place.type != T_CONS) return ERROR_TYPE;
@@ -1301,7 +1779,7 @@ error builtin_scdr(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_mod(struct vector *vargs, atom *result) {
+error builtin_mod(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 2) return ERROR_ARGS;
 	atom dividend = vargs->data[0];
 	atom divisor = vargs->data[1];
@@ -1311,25 +1789,27 @@ error builtin_mod(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_type(struct vector *vargs, atom *result) {
+error builtin_type(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom x = vargs->data[0];
 	switch (x.type) {
-	case T_CONS: *result = sym_cons; break;
+	case T_CONS: *result = ctx->sym_cons; break;
 	case T_SYM:
-	case T_NIL: *result = sym_sym; break;
+	case T_NIL: *result = ctx->sym_sym; break;
 	case T_BUILTIN:
 	case T_CLOSURE:
 	case T_CONTINUATION:
-		*result = sym_fn; break;
-	case T_STRING: *result = sym_string; break;
-	case T_NUM: *result = sym_num; break;
-	case T_MACRO: *result = sym_mac; break;
-	case T_TABLE: *result = sym_table; break;
-	case T_CHAR: *result = sym_char; break;
+	case T_ESCAPE:
+		*result = ctx->sym_fn; break;
+	case T_STRING: *result = ctx->sym_string; break;
+	case T_NUM: *result = ctx->sym_num; break;
+	case T_MACRO: *result = ctx->sym_mac; break;
+	case T_TABLE: *result = ctx->sym_table; break;
+	case T_CHAR: *result = ctx->sym_char; break;
 	case T_INPUT: *result = make_sym("input"); break;
 	case T_INPUT_PIPE: *result = make_sym("input-pipe"); break;
 	case T_OUTPUT: *result = make_sym("output"); break;
+	case T_THREAD: *result = make_sym("thread"); break;
 	default: *result = nil; break; /* impossible */
 	}
 	return ERROR_OK;
@@ -1338,7 +1818,7 @@ error builtin_type(struct vector *vargs, atom *result) {
 /* sref obj value index
      obj: cons, string, table
  */
-error builtin_sref(struct vector *vargs, atom *result) {
+error builtin_sref(struct arc_vector *vargs, atom *result) {
 	atom index, obj, value;
 	size_t i;
 	if (vargs->size != 3) return ERROR_ARGS;
@@ -1354,7 +1834,10 @@ error builtin_sref(struct vector *vargs, atom *result) {
 	  *result = value;
 	  return ERROR_OK;
 	case T_STRING:
-	  obj.value.str->value[(long)index.value.number] = (char)value.value.ch;
+	  if (obj.value.str->mapped) return ERROR_TYPE; /* read-only */
+	  if (index.type != T_NUM) return ERROR_TYPE;
+	  if (!(index.value.number >= 0 && index.value.number < obj.value.str->len)) return ERROR_ARGS;
+	  obj.value.str->value[(size_t)index.value.number] = (char)value.value.ch;
 	  *result = value;
 	  return ERROR_OK;
 	case T_TABLE:
@@ -1366,10 +1849,29 @@ error builtin_sref(struct vector *vargs, atom *result) {
 	}
 }
 
-/* disp [arg [output-port]] */
-error builtin_disp(struct vector *vargs, atom *result) {
-	long l = vargs->size;
-	FILE *fp;
+/* Displays a, writing strings, symbols and chars straight into the
+ * buffer of fp */
+static void disp_fp(atom a, FILE *fp) {
+	switch (a.type) {
+	case T_STRING:
+		fwrite(a.value.str->value, 1, a.value.str->len, fp);
+		break;
+	case T_SYM:
+		fputs(a.value.symbol, fp);
+		break;
+	case T_CHAR:
+		putc(a.value.ch, fp);
+		break;
+	default:
+		print_fp(a, 0, fp);
+	}
+}
+
+/* disp [arg [output-port]] */
+error builtin_disp(struct arc_vector *vargs, atom *result) {
+	long l = vargs->size;
+	FILE *fp;
+	error err;
 	switch (l) {
 	case 0:
 		*result = nil;
@@ -1378,28 +1880,44 @@ error builtin_disp(struct vector *vargs, atom *result) {
 		fp = stdout;
 		break;
 	case 2:
-		fp = vargs->data[1].value.fp;
+		if ((err = port_fp(vargs->data[1], 0, &fp))) return err;
 		break;
 	default:
 		return ERROR_ARGS;
 	}
-	char *s = to_string(vargs->data[0], 0);
-	fprintf(fp, "%s", s);
-	free(s);
+	disp_fp(vargs->data[0], fp);
 	*result = nil;
 	return ERROR_OK;
 }
 
-error builtin_writeb(struct vector *vargs, atom *result) {
+/* pr args ...
+ * Displays the arguments on stdout and returns the first. */
+error builtin_pr(struct arc_vector *vargs, atom *result) {
+	size_t i;
+	for (i = 0; i < vargs->size; i++) disp_fp(vargs->data[i], stdout);
+	*result = vargs->size > 0 ? vargs->data[0] : nil;
+	return ERROR_OK;
+}
+
+/* prn args ...
+ * Like pr, followed by a newline. */
+error builtin_prn(struct arc_vector *vargs, atom *result) {
+	error err = builtin_pr(vargs, result);
+	putchar('\n');
+	return err;
+}
+
+error builtin_writeb(struct arc_vector *vargs, atom *result) {
 	long l = vargs->size;
 	FILE *fp;
+	error err;
 	switch (l) {
 	case 0: return ERROR_ARGS;
 	case 1:
 		fp = stdout;
 		break;
 	case 2:
-		fp = vargs->data[1].value.fp;
+		if ((err = port_fp(vargs->data[1], 0, &fp))) return err;
 		break;
 	default: return ERROR_ARGS;
 	}
@@ -1408,7 +1926,24 @@ error builtin_writeb(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_expt(struct vector *vargs, atom *result) {
+/* writebytes string [output-port]
+ * Writes all the bytes of the string with one fwrite. */
+error builtin_writebytes(struct arc_vector *vargs, atom *result) {
+	FILE *fp = stdout;
+	struct arc_str *s;
+	if (vargs->size < 1 || vargs->size > 2) return ERROR_ARGS;
+	if (vargs->data[0].type != T_STRING) return ERROR_TYPE;
+	if (vargs->size == 2) {
+		error err = port_fp(vargs->data[1], 0, &fp);
+		if (err) return err;
+	}
+	s = vargs->data[0].value.str;
+	if (fwrite(s->value, 1, s->len, fp) != s->len) return ERROR_FILE;
+	*result = nil;
+	return ERROR_OK;
+}
+
+error builtin_expt(struct arc_vector *vargs, atom *result) {
 	atom a, b;
 	if (vargs->size != 2) return ERROR_ARGS;
 	a = vargs->data[0];
@@ -1417,7 +1952,7 @@ error builtin_expt(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_log(struct vector *vargs, atom *result) {
+error builtin_log(struct arc_vector *vargs, atom *result) {
 	atom a;
 	if (vargs->size != 1) return ERROR_ARGS;
 	a = vargs->data[0];
@@ -1425,7 +1960,7 @@ error builtin_log(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_sqrt(struct vector *vargs, atom *result) {
+error builtin_sqrt(struct arc_vector *vargs, atom *result) {
 	atom a;
 	if (vargs->size != 1) return ERROR_ARGS;
 	a = vargs->data[0];
@@ -1433,15 +1968,19 @@ error builtin_sqrt(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_readline(struct vector *vargs, atom *result) {
+error builtin_readline(struct arc_vector *vargs, atom *result) {
 	long l = vargs->size;
 	char *str;
 	if (l == 0) {
+		if (thread_wait_input(stdin)) return ERROR_RETRY;
 		str = readline("");
 	}
 	else if (l == 1) {
-		if (vargs->data[0].type != T_INPUT && vargs->data[0].type != T_INPUT_PIPE) return ERROR_TYPE;
-		str = readline_fp("", vargs->data[0].value.fp);
+		FILE *fp;
+		error err = port_fp(vargs->data[0], 1, &fp);
+		if (err) return err;
+		if (thread_wait_input(fp)) return ERROR_RETRY;
+		str = readline_fp("", fp);
 	}
 	else {
 		return ERROR_ARGS;
@@ -1450,7 +1989,7 @@ error builtin_readline(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_quit(struct vector *vargs, atom *result) {
+error builtin_quit(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 0) return ERROR_ARGS;
 	exit(0);
 }
@@ -1459,7 +1998,7 @@ double rand_double() {
 	return (double)rand() / ((double)RAND_MAX + 1.0);
 }
 
-error builtin_rand(struct vector *vargs, atom *result) {
+error builtin_rand(struct arc_vector *vargs, atom *result) {
 	long alen = vargs->size;
 	if (alen == 0) *result = make_number(rand_double());
 	else if (alen == 1) *result = make_number(floor(rand_double() * vargs->data[0].value.number));
@@ -1467,32 +2006,115 @@ error builtin_rand(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error read_fp(FILE *fp, atom *result) {
-	char *s = readline_fp("", fp);
-	if (s == NULL) return ERROR_FILE;
-	const char *buf = s;
-	error err = read_expr(buf, &buf, result);
+#ifdef _WIN32
+#define flockfile(fp)
+#define funlockfile(fp)
+#define getc_unlocked getc
+#endif
 
-	/* bring back remaining expressions so that "(read) (read)" works */
-	if (buf) {
-		if (*buf) ungetc('\n', fp);
-		const char *b0 = buf;
-		for (; *buf; buf++) {
-		}
-		for (buf--; buf >= b0; buf--) {
-			ungetc(*buf, fp);
+/* Counts the lines it passes in *line, and sets *start to the line the
+ * expression starts on */
+static error read_text_locked(FILE *fp, struct string *s, long *line, long *start) {
+	int c, depth = 0;
+	s->len = 0;
+	s->str[0] = 0;
+	for (;;) {
+		if ((c = getc_unlocked(fp)) == EOF) /* the end, or in an open form */
+			return s->len == 0 ? ERROR_FILE : ERROR_SYNTAX;
+		if (s->len == 0) *start = *line;
+		switch (c) {
+		case '\n':
+			++*line;
+			/* fall through */
+		case ' ': case '\t': case '\r':
+			if (s->len > 0) string_putc(s, (char)c);
+			continue;
+		case ';':
+			while ((c = getc_unlocked(fp)) != EOF && c != '\n') {
+			}
+			if (c == '\n') ++*line;
+			if (s->len > 0) string_putc(s, '\n');
+			continue;
+		case '\'': case '`': case ',': /* the expression follows */
+			string_putc(s, (char)c);
+			continue;
+		case '(': case '[':
+			string_putc(s, (char)c);
+			depth++;
+			continue;
+		case ')': case ']':
+			string_putc(s, (char)c);
+			if (depth > 0) depth--;
+			break;
+		case '"':
+			string_putc(s, (char)c);
+			while ((c = getc_unlocked(fp)) != '"') {
+				if (c == EOF) return ERROR_SYNTAX;
+				if (c == '\n') ++*line;
+				string_putc(s, (char)c);
+				if (c == '\\') {
+					if ((c = getc_unlocked(fp)) == EOF) return ERROR_SYNTAX;
+					string_putc(s, (char)c);
+				}
+			}
+			string_putc(s, (char)c);
+			break;
+		default: /* a token, up to a delimiter */
+			do {
+				string_putc(s, (char)c);
+			} while ((c = getc_unlocked(fp)) != EOF && !is_delim((char)c));
+			if (c != EOF) ungetc(c, fp);
 		}
+		if (depth == 0) break;
+	}
+	/* the rest of the line, if blank, goes with the expression */
+	while ((c = getc_unlocked(fp)) == ' ' || c == '\t' || c == '\r') {
+	}
+	if (c == '\n') ++*line;
+	else if (c != EOF) ungetc(c, fp);
+	return ERROR_OK;
+}
+
+/* Reads the text of the next expression, counting lines as
+ * read_text_locked does */
+static error read_text_fp_lines(FILE *fp, struct string *s, long *line, long *start) {
+	error err;
+	flockfile(fp); /* once, not for every character */
+	err = read_text_locked(fp, s, line, start);
+	funlockfile(fp);
+	return err;
+}
+
+/* Reads the text of the next expression of fp into s, which string_new
+ * made, and no further than the end of its line. Only the expression is
+ * kept in memory, and fp's own buffer is the only lookahead. Returns
+ * ERROR_FILE at the end of fp, or ERROR_SYNTAX if it ends in an expression. */
+error read_text_fp(FILE *fp, struct string *s) {
+	long line = 0, start;
+	return read_text_fp_lines(fp, s, &line, &start);
+}
+
+/* Reads an expression from fp; ERROR_FILE at the end */
+error read_fp(FILE *fp, atom *result) {
+	struct string s;
+	error err;
+	string_new(&s);
+	err = read_text_fp(fp, &s);
+	if (!err) {
+		const char *p = s.str;
+		err = read_expr(p, &p, result);
 	}
-	free(s);
+	free(s.str);
 	return err;
 }
 
 /* read [input-source [eof]]
 Reads a S-expression from the input-source, which can be either a string or an input-port. If the end of file is reached, nil is returned or the specified eof value. */
-error builtin_read(struct vector *vargs, atom *result) {
+error builtin_read(struct arc_vector *vargs, atom *result) {
 	size_t alen = vargs->size;
 	error err;
 	if (alen == 0) {
+		if (thread_wait_input(stdin)) return ERROR_RETRY;
 		err = read_fp(stdin, result);
 	}
 	else if (alen <= 2) {
@@ -1503,7 +2125,10 @@ error builtin_read(struct vector *vargs, atom *result) {
 			err = read_expr(buf, &buf, result);
 		}
 		else if (src.type == T_INPUT || src.type == T_INPUT_PIPE) {
-			err = read_fp(src.value.fp, result);
+			FILE *fp;
+			if ((err = port_fp(src, 1, &fp))) return err;
+			if (thread_wait_input(fp)) return ERROR_RETRY;
+			err = read_fp(fp, result);
 		}
 		else {
 			return ERROR_TYPE;
@@ -1527,7 +2152,7 @@ error builtin_read(struct vector *vargs, atom *result) {
 	}
 }
 
-error builtin_macex(struct vector *vargs, atom *result) {
+error builtin_macex(struct arc_vector *vargs, atom *result) {
 	long alen = vargs->size;
 	if (alen == 1) {
 		error err = macex(vargs->data[0], result);
@@ -1542,22 +2167,20 @@ error builtin_macex(struct vector *vargs, atom *result) {
  * Every argument will appear as it would look if printed out by pr,
  * except nil, which is ignored.
  */
-error builtin_string(struct vector *vargs, atom *result) {	
+error builtin_string(struct arc_vector *vargs, atom *result) {	
 	struct string s;
 	string_new(&s);
 	size_t i;
 	for (i = 0; i < vargs->size; i++) {
 		if (!no(vargs->data[i])) {
-			char *a = to_string(vargs->data[i], 0);
-			string_cat(&s, a);
-			free(a);
+			to_string_cat(&s, vargs->data[i], 0);
 		}
 	}
-	*result = make_string(s.str);
+	*result = make_string_len(s.str, s.len);
 	return ERROR_OK;
 }
 
-error builtin_sym(struct vector *vargs, atom *result) {
+error builtin_sym(struct arc_vector *vargs, atom *result) {
 	long alen = vargs->size;
 	if (alen == 1) {
 		char *s = to_string(vargs->data[0], 0);
@@ -1568,33 +2191,34 @@ error builtin_sym(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_system(struct vector *vargs, atom *result) {
+error builtin_system(struct arc_vector *vargs, atom *result) {
 	long alen = vargs->size;
 	if (alen == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_STRING) return ERROR_TYPE;
+		fflush(NULL); /* so the output comes out in order */
 		*result = make_number(system(vargs->data[0].value.str->value));
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
 }
 
-error builtin_eval(struct vector *vargs, atom *result) {
+error builtin_eval(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) return macex_eval(vargs->data[0], result);
 	else return ERROR_ARGS;
 }
 
-error builtin_load(struct vector *vargs, atom *result) {
+error builtin_load(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_STRING) return ERROR_TYPE;
 		*result = nil;
-		return arc_load_file(a.value.str->value);
+		return load_file(a.value.str->value);
 	}
 	else return ERROR_ARGS;
 }
 
-error builtin_int(struct vector *vargs, atom *result) {
+error builtin_int(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		switch (a.type) {
@@ -1618,7 +2242,7 @@ error builtin_int(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_trunc(struct vector *vargs, atom *result) {
+error builtin_trunc(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_NUM) return ERROR_TYPE;
@@ -1628,7 +2252,7 @@ error builtin_trunc(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_sin(struct vector *vargs, atom *result) {
+error builtin_sin(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_NUM) return ERROR_TYPE;
@@ -1638,7 +2262,7 @@ error builtin_sin(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_cos(struct vector *vargs, atom *result) {
+error builtin_cos(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_NUM) return ERROR_TYPE;
@@ -1648,7 +2272,7 @@ error builtin_cos(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_tan(struct vector *vargs, atom *result) {
+error builtin_tan(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_NUM) return ERROR_TYPE;
@@ -1658,50 +2282,119 @@ error builtin_tan(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_bound(struct vector *vargs, atom *result) {
+error builtin_bound(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_SYM) return ERROR_TYPE;
-		error err = env_get(env, a.value.symbol, result);
-		*result = (err ? nil : sym_t);
+		error err = env_get(ctx->env, a.value.symbol, result);
+		*result = (err ? nil : ctx->sym_t);
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
 }
 
-error builtin_infile(struct vector *vargs, atom *result) {
+/* Called when opening a file failed. If the process ran out of file
+ * descriptors, collects the unreachable ports, which closes them, and
+ * returns 1 if that freed any. vargs stay alive. */
+static int port_reclaim(struct arc_vector *vargs) {
+	size_t ss = ctx->stack_size, open = ctx->open_ports, i;
+	if (errno != EMFILE && errno != ENFILE) return 0;
+	for (i = 0; i < vargs->size; i++) stack_add(vargs->data[i]);
+	gc();
+	stack_restore(ss);
+	return ctx->open_ports < open;
+}
+
+error builtin_infile(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_STRING) return ERROR_TYPE;
 		FILE *fp = fopen(a.value.str->value, "r");
+		if (fp == NULL && port_reclaim(vargs)) fp = fopen(a.value.str->value, "r");
+		if (fp == NULL) return ERROR_FILE;
 		*result = make_input(fp);
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
 }
 
-error builtin_outfile(struct vector *vargs, atom *result) {
+/* Gives p a buffer of size bytes in the given mode (_IOFBF, _IOLBF or
+ * _IONBF), before any I/O on it */
+static error port_setvbuf(struct arc_port *p, int mode, size_t size) {
+	char *buf = mode == _IONBF || size == 0 ? NULL : malloc(size);
+	if (!p->fp || setvbuf(p->fp, buf, mode, size)) {
+		free(buf);
+		return ERROR_FILE;
+	}
+	if (port_std(p))
+		return ERROR_OK; /* never closed, so buf stays for good */
+	free(p->buf);
+	p->buf = buf;
+	return ERROR_OK;
+}
+
+error builtin_outfile(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 1) {
 		atom a = vargs->data[0];
 		if (a.type != T_STRING) return ERROR_TYPE;
 		FILE *fp = fopen(a.value.str->value, "w");
+		if (fp == NULL && port_reclaim(vargs)) fp = fopen(a.value.str->value, "w");
+		if (fp == NULL) return ERROR_FILE;
 		*result = make_output(fp);
+		port_setvbuf(result->value.port, _IOFBF, 1 << 16); /* fewer, larger writes */
 		return ERROR_OK;
 	}
 	else return ERROR_ARGS;
 }
 
+/* setvbuf port mode [size]
+ * Sets how a port is buffered, before it is used. mode is full, line or
+ * none; size is the size of the buffer in bytes. */
+error builtin_setvbuf(struct arc_vector *vargs, atom *result) {
+	atom port, mode;
+	const char *m;
+	size_t size = BUFSIZ;
+	int how;
+	if (vargs->size < 2 || vargs->size > 3) return ERROR_ARGS;
+	port = vargs->data[0];
+	mode = vargs->data[1];
+	if (port.type != T_INPUT && port.type != T_INPUT_PIPE && port.type != T_OUTPUT) return ERROR_TYPE;
+	if (mode.type != T_SYM) return ERROR_TYPE;
+	if (vargs->size == 3) {
+		if (vargs->data[2].type != T_NUM || vargs->data[2].value.number < 1) return ERROR_TYPE;
+		size = (size_t)vargs->data[2].value.number;
+	}
+	m = mode.value.symbol;
+	if (strcmp(m, "full") == 0) how = _IOFBF;
+	else if (strcmp(m, "line") == 0) how = _IOLBF;
+	else if (strcmp(m, "none") == 0) how = _IONBF;
+	else return ERROR_TYPE;
+	*result = nil;
+	return port_setvbuf(port.value.port, how, size);
+}
+
+/* flush [output-port]
+ * Writes out what is buffered for the port, stdout by default. */
+error builtin_flush(struct arc_vector *vargs, atom *result) {
+	FILE *fp = stdout;
+	if (vargs->size > 1) return ERROR_ARGS;
+	if (vargs->size == 1) {
+		error err = port_fp(vargs->data[0], 0, &fp);
+		if (err) return err;
+	}
+	if (fflush(fp)) return ERROR_FILE;
+	*result = nil;
+	return ERROR_OK;
+}
+
 /* close port ... */
-error builtin_close(struct vector *vargs, atom *result) {
+error builtin_close(struct arc_vector *vargs, atom *result) {
 	if (vargs->size >= 1) {
 		size_t i;
 		for (i = 0; i < vargs->size; i++) {
 			atom a = vargs->data[i];
 			if (a.type != T_INPUT && a.type != T_INPUT_PIPE && a.type != T_OUTPUT) return ERROR_TYPE;
-			if (a.type == T_INPUT_PIPE)
-				pclose(a.value.fp);
-			else
-				fclose(a.value.fp);
+			port_close(a.value.port, 1);
 		}
 		*result = nil;
 		return ERROR_OK;
@@ -1709,43 +2402,136 @@ error builtin_close(struct vector *vargs, atom *result) {
 	else return ERROR_ARGS;
 }
 
-error builtin_readb(struct vector *vargs, atom *result) {
+/* mmap-file path
+ * Returns the contents of a file as a read-only string that maps the file
+ * instead of copying it. The mapping goes when the string is collected. */
+error builtin_mmap_file(struct arc_vector *vargs, atom *result) {
+	char *path, *p;
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_STRING) return ERROR_TYPE;
+	path = vargs->data[0].value.str->value;
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	size_t size;
+	if (fd < 0) return ERROR_FILE;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return ERROR_FILE;
+	}
+	size = (size_t)st.st_size;
+	/* the file over zero pages, so that a 0 byte follows it */
+	p = mmap(NULL, size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED && size > 0 && mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, size + 1);
+		p = MAP_FAILED;
+	}
+	close(fd);
+	if (p == MAP_FAILED) return ERROR_FILE;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, size + 1, MADV_SEQUENTIAL);
+#endif
+	*result = make_string_len(p, size);
+	result->value.str->mapped = 1;
+#else
+	if (!(p = slurp(path))) return ERROR_FILE;
+	*result = make_string(p);
+#endif
+	return ERROR_OK;
+}
+
+/* instring string
+ * Returns an input port that reads the string in place. */
+error builtin_instring(struct arc_vector *vargs, atom *result) {
+	struct arc_str *s;
+	FILE *fp;
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_STRING) return ERROR_TYPE;
+	s = vargs->data[0].value.str;
+#ifndef _WIN32
+	fp = s->len > 0 ? fmemopen(s->value, s->len, "r") : fopen("/dev/null", "r");
+	if (!fp && port_reclaim(vargs)) fp = s->len > 0 ? fmemopen(s->value, s->len, "r") : fopen("/dev/null", "r");
+#else
+	if ((fp = tmpfile())) {
+		fwrite(s->value, 1, s->len, fp);
+		rewind(fp);
+	}
+#endif
+	if (!fp) return ERROR_FILE;
+	*result = make_input(fp);
+	result->value.port->s = vargs->data[0];
+	return ERROR_OK;
+}
+
+error builtin_readb(struct arc_vector *vargs, atom *result) {
 	long l = vargs->size;
 	FILE *fp;
+	error err;
 	switch (l) {
 	case 0:
 		fp = stdin;
 		break;
 	case 1:
-		fp = vargs->data[0].value.fp;
+		if ((err = port_fp(vargs->data[0], 1, &fp))) return err;
 		break;
 	default:
 		return ERROR_ARGS;
 	}
+	if (thread_wait_input(fp)) return ERROR_RETRY;
 	*result = make_number(fgetc(fp));
 	return ERROR_OK;
 }
 
+/* readbytes n [input-port]
+ * Reads up to n bytes with one fread, as a string that may hold 0 bytes.
+ * Returns nil at the end of the input. */
+error builtin_readbytes(struct arc_vector *vargs, atom *result) {
+	FILE *fp = stdin;
+	size_t n, got;
+	char *buf;
+	if (vargs->size < 1 || vargs->size > 2) return ERROR_ARGS;
+	if (vargs->data[0].type != T_NUM || vargs->data[0].value.number < 0) return ERROR_TYPE;
+	if (vargs->size == 2) {
+		error err = port_fp(vargs->data[1], 1, &fp);
+		if (err) return err;
+	}
+	if (vargs->data[0].value.number >= (double)(size_t)-1) return ERROR_ARGS;
+	n = (size_t)vargs->data[0].value.number;
+	if (thread_wait_input(fp)) return ERROR_RETRY;
+	buf = malloc(n + 1);
+	if (!buf) return ERROR_ARGS; /* more than can be allocated */
+	got = fread(buf, 1, n, fp);
+	if (got == 0 && n > 0) {
+		free(buf);
+		*result = nil;
+		return ERROR_OK;
+	}
+	if (got < n) buf = realloc(buf, got + 1);
+	buf[got] = 0;
+	*result = make_string_len(buf, got);
+	return ERROR_OK;
+}
+
 /* sread input-port eof */
-error builtin_sread(struct vector *vargs, atom *result) {
-	if (vargs->size != 2) return ERROR_ARGS;
-	FILE *fp = vargs->data[0].value.fp;
-	atom eof = vargs->data[1];
+error builtin_sread(struct arc_vector *vargs, atom *result) {
 	error err;
-	if (feof(fp)) {
-		*result = eof;
+	if (vargs->size != 2) return ERROR_ARGS;
+	FILE *fp;
+	if ((err = port_fp(vargs->data[0], 1, &fp))) return err;
+	if (thread_wait_input(fp)) return ERROR_RETRY;
+	err = read_fp(fp, result);
+	if (err == ERROR_FILE) { /* at the end */
+		*result = vargs->data[1];
 		return ERROR_OK;
 	}
-	char *s = slurp_fp(fp);
-	const char *p = s;
-	err = read_expr(p, &p, result);
 	return err;
 }
 
 /* write [arg [output-port]] */
-error builtin_write(struct vector *vargs, atom *result) {
+error builtin_write(struct arc_vector *vargs, atom *result) {
 	long l = vargs->size;
 	FILE *fp;
+	error err;
 	switch (l) {
 	case 0:
 		*result = nil;
@@ -1754,23 +2540,21 @@ error builtin_write(struct vector *vargs, atom *result) {
 		fp = stdout;
 		break;
 	case 2:
-		fp = vargs->data[1].value.fp;
+		if ((err = port_fp(vargs->data[1], 0, &fp))) return err;
 		break;
 	default:
 		return ERROR_ARGS;
 	}
 	atom a = vargs->data[0];
 	if (a.type == T_STRING) fputc('"', fp);
-	char *s = to_string(a, 1);
-	fprintf(fp, "%s", s);
+	print_fp(a, 1, fp);
 	if (a.type == T_STRING) fputc('"', fp);
-	free(s);
 	*result = nil;
 	return ERROR_OK;
 }
 
 /* newstring length [char] */
-error builtin_newstring(struct vector *vargs, atom *result) {
+error builtin_newstring(struct arc_vector *vargs, atom *result) {
 	long arg_len = vargs->size;
 	long length = (long)vargs->data[0].value.number;
 	char c = 0;
@@ -1792,15 +2576,35 @@ error builtin_newstring(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_table(struct vector *vargs, atom *result) {
+error builtin_table(struct arc_vector *vargs, atom *result) {
 	long arg_len = vargs->size;
 	if (arg_len != 0) return ERROR_ARGS;
 	*result = make_table(8);
 	return ERROR_OK;
 }
 
+/* weak-table
+ * Returns a table whose entries gc drops once their keys are reachable
+ * from nowhere else. Numbers, symbols and characters are always reachable. */
+error builtin_weak_table(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_weak_table(8);
+	return ERROR_OK;
+}
+
+/* cache-table n
+ * Returns a table that holds at most n entries, dropping the least
+ * recently read or written one to make room. */
+error builtin_cache_table(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+	if (vargs->data[0].value.number < 1) return ERROR_ARGS;
+	*result = make_cache_table((size_t)vargs->data[0].value.number);
+	return ERROR_OK;
+}
+
 /* maptable proc table */
-error builtin_maptable(struct vector *vargs, atom *result) {
+error builtin_maptable(struct arc_vector *vargs, atom *result) {
 	long arg_len = vargs->size;
 	if (arg_len != 2) return ERROR_ARGS;
 	atom proc = vargs->data[0];
@@ -1831,86 +2635,86 @@ A string can be coerced to sym, cons (char list), num, or int.
 A list of characters can be coerced to a string.
 A symbol can be coerced to a string.
 */
-error builtin_coerce(struct vector *vargs, atom *result) {
+error builtin_coerce(struct arc_vector *vargs, atom *result) {
 	atom obj, type;
 	if (vargs->size != 2) return ERROR_ARGS;
 	obj = vargs->data[0];
 	type = vargs->data[1];
 	switch (obj.type) {
 	case T_CHAR:
-		if (is(type, sym_int) || is(type, sym_num)) *result = make_number(obj.value.ch);
-		else if (is(type, sym_string)) {
+		if (is(type, ctx->sym_int) || is(type, ctx->sym_num)) *result = make_number(obj.value.ch);
+		else if (is(type, ctx->sym_string)) {
 			char *buf = malloc(2);
 			buf[0] = obj.value.ch;
 			buf[1] = '\0';
 			*result = make_string(buf);
 		}
-		else if (is(type, sym_sym)) {
+		else if (is(type, ctx->sym_sym)) {
 			char buf[2];
 			buf[0] = obj.value.ch;
 			buf[1] = '\0';
 			*result = make_sym(buf);
 		}
-		else if (is(type, sym_char))
+		else if (is(type, ctx->sym_char))
 			*result = obj;
 		else
 			return ERROR_TYPE;
 		break;
 	case T_NUM:
-		if (is(type, sym_int)) *result = make_number(floor(obj.value.number));
-		else if (is(type, sym_char)) *result = make_char((char)obj.value.number);
-		else if (is(type, sym_string)) {
+		if (is(type, ctx->sym_int)) *result = make_number(floor(obj.value.number));
+		else if (is(type, ctx->sym_char)) *result = make_char((char)obj.value.number);
+		else if (is(type, ctx->sym_string)) {
 			*result = make_string(to_string(obj, 0));
 		}
-		else if (is(type, sym_num))
+		else if (is(type, ctx->sym_num))
 			*result = obj;
 		else
 			return ERROR_TYPE;
 		break;
 	case T_STRING:
-		if (is(type, sym_sym)) *result = make_sym(obj.value.str->value);
-		else if (is(type, sym_cons)) {
+		if (is(type, ctx->sym_sym)) *result = make_sym(obj.value.str->value);
+		else if (is(type, ctx->sym_cons)) {
 			*result = nil;
 			int i;
 			for (i = strlen(obj.value.str->value) - 1; i >= 0; i--) {
 				*result = cons(make_char(obj.value.str->value[i]), *result);
 			}
 		}
-		else if (is(type, sym_num)) *result = make_number(atof(obj.value.str->value));
-		else if (is(type, sym_int)) *result = make_number(atoi(obj.value.str->value));
-		else if (is(type, sym_string))
+		else if (is(type, ctx->sym_num)) *result = make_number(atof(obj.value.str->value));
+		else if (is(type, ctx->sym_int)) *result = make_number(atoi(obj.value.str->value));
+		else if (is(type, ctx->sym_string))
 			*result = obj;
 		else
 			return ERROR_TYPE;
 		break;
 	case T_CONS:
-		if (is(type, sym_string)) {
+		if (is(type, ctx->sym_string)) {
 			struct string s;
 			string_new(&s);
 			atom p;
 			for (p = obj; !no(p); p = cdr(p)) {
 				atom x;
-				struct vector v; /* (car(p) string) */
+				struct arc_vector v; /* (car(p) string) */
 				vector_new(&v);
 				vector_add(&v, car(p));
-				vector_add(&v, sym_string);
+				vector_add(&v, ctx->sym_string);
 				error err = builtin_coerce(&v, &x);
 				vector_free(&v);
 				if (err) return err;
-				string_cat(&s, x.value.str->value);
+				string_cat_len(&s, x.value.str->value, x.value.str->len);
 			}
-			*result = make_string(s.str);
+			*result = make_string_len(s.str, s.len);
 		}
-		else if (is(type, sym_cons))
+		else if (is(type, ctx->sym_cons))
 			*result = obj;
 		else
 			return ERROR_TYPE;
 		break;
 	case T_SYM:
-		if (is(type, sym_string)) {
+		if (is(type, ctx->sym_string)) {
 			*result = make_string(strdup(obj.value.symbol));
 		}
-		else if (is(type, sym_sym))
+		else if (is(type, ctx->sym_sym))
 			*result = obj;
 		else
 			return ERROR_TYPE;
@@ -1921,16 +2725,16 @@ error builtin_coerce(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-error builtin_flushout(struct vector *vargs, atom *result) {
+error builtin_flushout(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 0) return ERROR_ARGS;
 	fflush(stdout);
-	*result = sym_t;
+	*result = ctx->sym_t;
 	return ERROR_OK;
 }
 
-error builtin_err(struct vector *vargs, atom *result) {
+error builtin_err(struct arc_vector *vargs, atom *result) {
 	if (vargs->size == 0) return ERROR_ARGS;
-	cur_expr = nil;
+	ctx->cur_expr = nil;
 	size_t i;
 	for (i = 0; i < vargs->size; i++) {
 		char *s = to_string(vargs->data[i], 0);
@@ -1940,11 +2744,11 @@ error builtin_err(struct vector *vargs, atom *result) {
 	return ERROR_USER;
 }
 
-error builtin_len(struct vector *vargs, atom *result) {
+error builtin_len(struct arc_vector *vargs, atom *result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom a = vargs->data[0];
 	if (a.type == T_STRING) {
-		*result = make_number(strlen(a.value.str->value));
+		*result = make_number(a.value.str->len);
 	}
 	else if (a.type == T_TABLE) {
 		*result = make_number(a.value.table->size);
@@ -1955,240 +2759,1848 @@ error builtin_len(struct vector *vargs, atom *result) {
 	return ERROR_OK;
 }
 
-atom make_continuation(jmp_buf *jb) {
-	atom a;
-	a.type = T_CONTINUATION;
-	a.value.jb = jb;
-	return a;
+/* ccc f
+ * Calls f with the current continuation. The evaluator implements it; this
+ * entry point serves calls from C through apply. */
+error builtin_ccc(struct arc_vector *vargs, atom *result) {
+	return eval_apply(make_builtin(builtin_ccc), vargs->data, vargs->size, nil, result);
 }
 
-error builtin_ccc(struct vector *vargs, atom *result) {
-	if (vargs->size != 1) return ERROR_ARGS;
-	atom a = vargs->data[0];
-	if (a.type != T_BUILTIN && a.type != T_CLOSURE) return ERROR_TYPE;
-	jmp_buf jb;
-	int val = setjmp(jb);
-	if (val) {
-		*result = thrown;
-		return ERROR_OK;
-	}
-	vector_clear(vargs);
-	vector_add(vargs, make_continuation(&jb));
-	return apply(a, vargs, result);
+/* call/ec f
+ * Like ccc, but the continuation may only be used to escape while f is
+ * running. It is allocation free, which makes it the basis of point. */
+error builtin_call_ec(struct arc_vector *vargs, atom *result) {
+	return eval_apply(make_builtin(builtin_call_ec), vargs->data, vargs->size, nil, result);
 }
 
 /* pipe-from command
  * Executes command in the underlying OS. Then opens an input-port to the results.
  */
-error builtin_pipe_from(struct vector* vargs, atom* result) {
+error builtin_pipe_from(struct arc_vector* vargs, atom* result) {
 	if (vargs->size != 1) return ERROR_ARGS;
 	atom a = vargs->data[0];
 	if (a.type != T_STRING) return ERROR_TYPE;
+	fflush(NULL); /* so the output comes out in order */
 	FILE *fp = popen(vargs->data[0].value.str->value, "r");
+	if (fp == NULL && port_reclaim(vargs)) fp = popen(vargs->data[0].value.str->value, "r");
 	if (fp == NULL) return ERROR_FILE;
 	*result = make_input_pipe(fp);
 	return ERROR_OK;
 }
 
-/* end builtin */
+#ifndef _WIN32
+extern char **environ;
+
+/* Starts argv with posix_spawnp. For each i of 0, 1 and 2 for which
+ * ports[i] is wanted, the child's stdin, stdout or stderr is a pipe whose
+ * other end becomes ports[i]; the ports are registered with the child's
+ * pid so that closing the last one waits for it. */
+static error spawn(char **argv, int want[3], atom ports[3]) {
+	posix_spawn_file_actions_t fa;
+	int fds[3][2], i, err, pipe_errno = 0;
+	pid_t pid;
+	posix_spawn_file_actions_init(&fa);
+	for (i = 0; i < 3; i++) {
+		fds[i][0] = fds[i][1] = -1;
+		if (!want[i]) continue;
+		if (pipe(fds[i])) {
+			pipe_errno = errno; /* for port_reclaim */
+			break;
+		}
+		/* no other child may hold on to these */
+		fcntl(fds[i][0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[i][1], F_SETFD, FD_CLOEXEC);
+		posix_spawn_file_actions_adddup2(&fa, fds[i][i == 0 ? 0 : 1], i);
+	}
+	fflush(NULL); /* so the output comes out in order */
+	err = i < 3 ? -1 : posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	for (i = 0; i < 3; i++) {
+		int mine = i == 0 ? 1 : 0; /* the parent writes the child's stdin */
+		if (fds[i][0] < 0) continue;
+		close(fds[i][1 - mine]);
+		if (err) {
+			close(fds[i][mine]);
+			continue;
+		}
+		FILE *fp = fdopen(fds[i][mine], i == 0 ? "w" : "r");
+		ports[i] = i == 0 ? make_output(fp) : make_input(fp);
+		ports[i].value.port->pid = pid;
+	}
+	errno = pipe_errno;
+	return err ? ERROR_FILE : ERROR_OK;
+}
+#endif
 
-void string_new(struct string *dst) {
-	dst->len = 0;
-	dst->cap = 2;
-	dst->str = malloc(dst->cap * sizeof(char));
-	dst->str[0] = 0;
+/* pipe-to command
+ * Returns an output port to the standard input of a shell running the
+ * command. Closing the port waits for the command to finish. */
+error builtin_pipe_to(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_STRING) return ERROR_TYPE;
+#ifndef _WIN32
+	char *argv[] = { "sh", "-c", vargs->data[0].value.str->value, NULL };
+	int want[3] = { 1, 0, 0 };
+	atom ports[3];
+	error err = spawn(argv, want, ports);
+	if (err && port_reclaim(vargs)) err = spawn(argv, want, ports);
+	if (err) return err;
+	*result = ports[0];
+	return ERROR_OK;
+#else
+	return ERROR_FILE;
+#endif
 }
 
-void string_cat(struct string* dst, char* src) {
-	size_t len = dst->len + strlen(src);
-	
-	if (len + 1 > dst->cap) {		
-		while (len + 1 > dst->cap) {
-			dst->cap *= 2;
-		}
-		dst->str = realloc(dst->str, dst->cap * sizeof(char));
+/* process program arg ...
+ * Runs the program, found on the PATH, with the arguments and no shell.
+ * Returns (in out err pid): an output port to its standard input, input
+ * ports from its standard output and error, and its process id. Closing
+ * the last of the ports waits for the program to finish. */
+error builtin_process(struct arc_vector *vargs, atom *result) {
+	size_t i;
+	if (vargs->size < 1) return ERROR_ARGS;
+	for (i = 0; i < vargs->size; i++) {
+		if (vargs->data[i].type != T_STRING) return ERROR_TYPE;
 	}
-	
-	strcpy(dst->str + dst->len, src);
-	dst->len = len;
+#ifndef _WIN32
+	char **argv = malloc((vargs->size + 1) * sizeof(char *));
+	int want[3] = { 1, 1, 1 };
+	atom ports[3];
+	error err;
+	for (i = 0; i < vargs->size; i++) argv[i] = vargs->data[i].value.str->value;
+	argv[i] = NULL;
+	err = spawn(argv, want, ports);
+	if (err && port_reclaim(vargs)) err = spawn(argv, want, ports);
+	free(argv);
+	if (err) return err;
+	*result = cons(ports[0], cons(ports[1], cons(ports[2],
+		cons(make_number(ports[0].value.port->pid), nil))));
+	return ERROR_OK;
+#else
+	return ERROR_FILE;
+#endif
 }
 
-char *to_string(atom a, int write) {
-	struct string s;
-	string_new(&s);
+/* processor time used by the process */
+double process_seconds() {
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
 
-	char buf[80];
-	switch (a.type) {
-	case T_NIL:
-		string_cat(&s, "nil");
-		break;
-	case T_CONS:
-		if (listp(a) && len(a) == 2 && is(car(a), sym_quote)) {
-			string_cat(&s, "'");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
-		}
-		else if (listp(a) && len(a) == 2 && is(car(a), sym_quasiquote)) {
-			string_cat(&s, "`");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
-		}
-		else if (listp(a) && len(a) == 2 && is(car(a), sym_unquote)) {
-			string_cat(&s, ",");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
-		}
-		else if (listp(a) && len(a) == 2 && is(car(a), sym_unquote_splicing)) {
-			string_cat(&s, ",@");
-			char *s2 = to_string(car(cdr(a)), write);
-			string_cat(&s, s2);
-			free(s2);
+double now_seconds() {
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return GetTickCount64() / 1000.0;
+#endif
+}
+
+void sleep_seconds(double secs) {
+	if (secs <= 0) return;
+#ifndef _WIN32
+	struct timespec ts;
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	/* resume when interrupted, e.g. by the SIGPROF of the sampling profiler */
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+	}
+#else
+	Sleep((DWORD)(secs * 1000));
+#endif
+}
+
+#ifndef _WIN32
+/* whether fp has input in its buffer that reading would return without
+ * touching the descriptor */
+static int input_buffered(FILE *fp) {
+#if defined(__GLIBC__)
+	return fp->_IO_read_ptr < fp->_IO_read_end;
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+	return fp->_r > 0;
+#else
+	return 1; /* unknown stdio: never suspend on it */
+#endif
+}
+
+static int fd_ready(int fd) {
+	struct pollfd p;
+	p.fd = fd;
+	p.events = POLLIN;
+	return poll(&p, 1, 0) != 0;
+}
+#endif
+
+/* Called by a builtin before it reads fp. Returns nonzero if the read would
+ * block and the current thread has been set to wait for input instead; the
+ * builtin then returns ERROR_RETRY and is called again once fp is readable. */
+int thread_wait_input(FILE *fp) {
+#ifndef _WIN32
+	if (!ctx->yield_ok || ctx->thread_count < 2 || input_buffered(fp)) return 0;
+	int fd = fileno(fp);
+	if (fd < 0 || fd_ready(fd)) return 0;
+	ctx->cur_thread->fd = fd;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* ready? input-port
+ * Whether reading the port would not block: data is buffered or waiting,
+ * or the input has ended. */
+error builtin_readyp(struct arc_vector *vargs, atom *result) {
+	FILE *fp;
+	if (vargs->size != 1) return ERROR_ARGS;
+	error err = port_fp(vargs->data[0], 1, &fp);
+	if (err) return err;
+#ifndef _WIN32
+	int fd = fileno(fp);
+	*result = feof(fp) || input_buffered(fp) || fd < 0 || fd_ready(fd) ? ctx->sym_t : nil;
+#else
+	*result = ctx->sym_t;
+#endif
+	return ERROR_OK;
+}
+
+atom make_thread(atom fn) {
+	atom a;
+	struct arc_thread *t;
+	ctx->alloc_count++;
+	t = a.value.thread = calloc(1, sizeof(struct arc_thread));
+	t->expr = t->env = t->val = nil;
+	t->fd = -1;
+	t->next = ctx->thread_head;
+	ctx->thread_head = t;
+	/* it starts by calling fn with no arguments */
+	t->es.value_capacity = 8;
+	t->es.values = malloc(t->es.value_capacity * sizeof(atom));
+	t->es.values[t->es.value_size++] = fn;
+	t->state = TS_CALL;
+	t->argv = 1;
+	if (ctx->thread_count == ctx->thread_capacity) {
+		ctx->thread_capacity = ctx->thread_capacity ? ctx->thread_capacity * 2 : 8;
+		ctx->threads = realloc(ctx->threads, ctx->thread_capacity * sizeof(struct arc_thread *));
+	}
+	ctx->threads[ctx->thread_count++] = t;
+	a.type = T_THREAD;
+	stack_add(a);
+	return a;
+}
+
+/* Removes t from the threads to schedule and returns its former index */
+size_t thread_remove(struct arc_thread *t) {
+	size_t i;
+	for (i = 0; i < ctx->thread_count; i++) {
+		if (ctx->threads[i] == t) {
+			memmove(ctx->threads + i, ctx->threads + i + 1, (ctx->thread_count - i - 1) * sizeof(struct arc_thread *));
+			ctx->thread_count--;
+			break;
 		}
-		else {
-			string_cat(&s, "(");
-			char *s2 = to_string(car(a), write);
-			string_cat(&s, s2);
-			free(s2);
-			a = cdr(a);
-			while (!no(a)) {
-				if (a.type == T_CONS) {
-					string_cat(&s, " ");
-					s2 = to_string(car(a), write);
-					string_cat(&s, s2);
-					free(s2);
-					a = cdr(a);
-				}
-				else {
-					string_cat(&s, " . ");
-					s2 = to_string(a, write);
-					string_cat(&s, s2);
-					free(s2);
-					break;
-				}
-			}
-			string_cat(&s, ")");
+	}
+	return i;
+}
+
+/* Ends thread t, which is not running: its continuations can no longer be
+ * entered and its stack is freed. Killing the main thread ends the program. */
+void thread_end(struct arc_thread *t) {
+	size_t i;
+	if (t == &ctx->main_thread) exit(0);
+	if (t->dead) return;
+	t->dead = 1;
+	for (i = 0; i < t->es.frame_size; i++) {
+		if (t->es.frames[i].kind == F_CCC)
+			t->es.frames[i].args.value.cont->live = 0;
+	}
+	free(t->es.frames);
+	free(t->es.values);
+	memset(&t->es, 0, sizeof(t->es));
+	t->expr = t->env = t->val = nil;
+	thread_remove(t);
+}
+
+/* Suspends the running thread, whose resume point has been saved, and makes
+ * the next thread that can run current, waiting while every thread sleeps or
+ * waits for input. A running thread that has died is dropped instead. */
+struct arc_thread *thread_switch() {
+	struct arc_thread *t = ctx->cur_thread;
+	size_t i, start;
+	if (t->dead) {
+		frames_unwind(0, 0);
+		free(ctx->es.frames);
+		free(ctx->es.values);
+		memset(&ctx->es, 0, sizeof(ctx->es));
+		t->expr = t->env = t->val = nil;
+		start = thread_remove(t);
+	}
+	else {
+		t->es = ctx->es;
+		for (start = 0; ctx->threads[start] != t; start++) {
 		}
-		break;
-	case T_SYM:
-		string_cat(&s, a.value.symbol);
-		break;
-	case T_STRING:
-		if (write) string_cat(&s, "\"");
-		string_cat(&s, a.value.str->value);
-		if (write) string_cat(&s, "\"");
-		break;
-	case T_NUM:
-		sprintf(buf, "%.16g", a.value.number);
-		string_cat(&s, buf);
-		break;
-	case T_BUILTIN:
-		sprintf(buf, "#<builtin:%p>", a.value.builtin);
-		string_cat(&s, buf);
-		break;
-	case T_CLOSURE:
-	{
-		atom a2 = cons(sym_fn, cdr(a));
-		char *s2 = to_string(a2, write);
-		string_cat(&s, s2);
-		free(s2);
-		break;
+		start++; /* the others go first */
 	}
-	case T_MACRO:
-		string_cat(&s, "#<macro:");
-		char *s2 = to_string(cdr(a), write);
-		string_cat(&s, s2);
-		free(s2);
-		string_cat(&s, ">");
-		break;
-	case T_INPUT:
-		string_cat(&s, "#<input>");
-		break;
-	case T_INPUT_PIPE:
-		string_cat(&s, "#<input-pipe>");
-		break;
-	case T_OUTPUT:
-		string_cat(&s, "#<output>");
-		break;
-	case T_TABLE: {
-		string_cat(&s, "#<table:");
-		size_t i;
-		for (i = 0; i < a.value.table->capacity; i++) {
-			struct table_entry *p = a.value.table->data[i];
-			while (p) {
-				char *s2 = to_string(p->k, write);
-				string_cat(&s, " ");
-				string_cat(&s, s2);
-				free(s2);
-				string_cat(&s, ":");
-				s2 = to_string(p->v, write);
-				string_cat(&s, s2);
-				free(s2);
-				p = p->next;
-			}
-		}
-		string_cat(&s, ">");
-		break; }
-	case T_CHAR:
-		if (write) {
-			string_cat(&s, "#\\");
-			switch (a.value.ch) {
-			case '\0': string_cat(&s, "nul"); break;
-			case '\r': string_cat(&s, "return"); break;
-			case '\n': string_cat(&s, "newline"); break;
-			case '\t': string_cat(&s, "tab"); break;
-			case ' ': string_cat(&s, "space"); break;
-			default:
-				buf[0] = a.value.ch;
-				buf[1] = '\0';
-				string_cat(&s, buf);
+	for (;;) {
+		double now = now_seconds(), wake = -1;
+		for (i = 0; i < ctx->thread_count; i++) {
+			struct arc_thread *c = ctx->threads[(start + i) % ctx->thread_count];
+			if (c->wake > now) {
+				if (wake < 0 || c->wake < wake) wake = c->wake;
+				continue;
 			}
+#ifndef _WIN32
+			if (c->fd >= 0 && !fd_ready(c->fd)) continue;
+#endif
+			c->wake = 0;
+			c->fd = -1;
+			ctx->cur_thread = c;
+			ctx->es = c->es;
+			ctx->yield_pending = 0;
+			ctx->sched_ticks = SCHED_SLICE;
+			return c;
 		}
-		else {
-			s.str[0] = a.value.ch;
-			s.str[1] = '\0';
+		/* nothing can run: wait for the first sleeper or for input */
+#ifndef _WIN32
+		struct pollfd *fds = malloc((ctx->thread_count + 1) * sizeof(struct pollfd));
+		nfds_t n = 0;
+		for (i = 0; i < ctx->thread_count; i++) {
+			if (ctx->threads[i]->fd >= 0) {
+				fds[n].fd = ctx->threads[i]->fd;
+				fds[n].events = POLLIN;
+				n++;
+			}
 		}
-		break;
-	case T_CONTINUATION:
-		string_cat(&s, "#<continuation>");
-		break;
-	default:
-		string_cat(&s, "#<unknown type>");
-		break;
+		poll(fds, n, wake < 0 ? -1 : (int)ceil((wake - now) * 1000));
+		free(fds);
+#else
+		sleep_seconds(wake - now);
+#endif
 	}
-	s.str = realloc(s.str, s.len + 1);
-	return s.str;
 }
 
-size_t hash_code_sym(char *s) {
-	return (size_t)s / sizeof(s) / 2;
+/* new-thread f
+ * Runs f with no arguments in a new green thread. */
+error builtin_new_thread(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	atom f = vargs->data[0];
+	if (f.type != T_BUILTIN && f.type != T_CLOSURE && f.type != T_CONTINUATION && f.type != T_ESCAPE)
+		return ERROR_TYPE;
+	*result = make_thread(f);
+	return ERROR_OK;
 }
 
-size_t hash_code(atom a) {
-	size_t r = 1;
-	switch (a.type) {
-	case T_NIL:
-		return 0;
-	case T_CONS:
-		while (!no(a)) {
-			r *= 31;
-			if (a.type == T_CONS) {
-				r += hash_code(car(a));
+error builtin_current_thread(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	result->type = T_THREAD;
+	result->value.thread = ctx->cur_thread;
+	return ERROR_OK;
+}
+
+/* kill-thread thread */
+error builtin_kill_thread(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_THREAD) return ERROR_TYPE;
+	struct arc_thread *t = vargs->data[0].value.thread;
+	if (t == ctx->cur_thread) {
+		if (t == &ctx->main_thread) exit(0);
+		t->dead = 1; /* dropped at the next switch */
+		ctx->yield_pending = 1;
+	}
+	else {
+		thread_end(t);
+	}
+	*result = nil;
+	return ERROR_OK;
+}
+
+/* dead thread */
+error builtin_dead(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_THREAD) return ERROR_TYPE;
+	*result = vargs->data[0].value.thread->dead ? ctx->sym_t : nil;
+	return ERROR_OK;
+}
+
+/* msec
+ * Milliseconds, with fractions, since an arbitrary point; for measuring. */
+error builtin_msec(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_number(now_seconds() * 1e3);
+	return ERROR_OK;
+}
+
+/* seconds
+ * Seconds since the epoch. */
+error builtin_seconds(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_number((double)time(NULL));
+	return ERROR_OK;
+}
+
+/* current-process-milliseconds
+ * Processor time used by the process, in all its threads. */
+error builtin_current_process_milliseconds(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_number(process_seconds() * 1e3);
+	return ERROR_OK;
+}
+
+/* current-gc-milliseconds
+ * Time spent collecting garbage in this interpreter. */
+error builtin_current_gc_milliseconds(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_number(ctx->gc_stats.pause_total * 1e3);
+	return ERROR_OK;
+}
+
+/* sleep seconds
+ * Other threads run meanwhile, unless sleep is called from atomic code or
+ * from a function called by a builtin. */
+error builtin_sleep(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+	double secs = vargs->data[0].value.number;
+	if (ctx->yield_ok) {
+		ctx->cur_thread->wake = now_seconds() + secs;
+		ctx->yield_pending = 1;
+	}
+	else {
+		sleep_seconds(secs);
+	}
+	*result = nil;
+	return ERROR_OK;
+}
+
+/* atomic-invoke f
+ * Calls f with no arguments. No other thread runs until it returns. */
+error builtin_atomic_invoke(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 1) return ERROR_ARGS;
+	/* f runs in a nested run of the evaluator, where threads are not switched */
+	return eval_apply(vargs->data[0], NULL, 0, nil, result);
+}
+
+/* A step of copy_atom. A value is copied into *to; a table entry and a
+ * global are added once their parts, copied into the pair holder, are. */
+struct copy_task {
+	enum { COPY_VALUE, COPY_TABLE_ADD, COPY_GLOBAL } kind;
+	atom from; /* the value, the new table or the symbol */
+	atom *to;
+	atom holder;
+};
+
+struct copy_stack {
+	struct copy_task *tasks;
+	size_t size, capacity;
+};
+
+static void copy_push(struct copy_stack *todo, int kind, atom from, atom *to, atom holder) {
+	struct copy_task *t;
+	if (todo->size == todo->capacity) {
+		todo->capacity = todo->capacity ? todo->capacity * 2 : 64;
+		todo->tasks = realloc(todo->tasks, todo->capacity * sizeof(struct copy_task));
+	}
+	t = &todo->tasks[todo->size++];
+	t->kind = kind;
+	t->from = from;
+	t->to = to;
+	t->holder = holder;
+}
+
+/* Gives the current context the global definitions that the code of a
+ * closure copied from src refers to, unless both contexts got them from
+ * the standard library. */
+static void copy_globals(struct arc_context *src, struct ptr_map *m, atom code, struct copy_stack *todo) {
+	struct arc_vector pending;
+	vector_new(&pending);
+	vector_add(&pending, code);
+	while (pending.size > 0) {
+		code = pending.data[--pending.size];
+		while (code.type == T_CONS) {
+			atom x = car(code);
+			if (x.type == T_CONS) {
+				vector_add(&pending, x);
+			}
+			else if (x.type == T_SYM && !ptr_map_get(m, x.value.symbol)) {
+				struct table_entry *e = table_get_sym(cdr(src->env).value.table, x.value.symbol);
+				struct table_entry *init = table_get_sym(src->initial_globals.value.table, x.value.symbol);
+				ptr_map_put(m, x.value.symbol, nil);
+				if (e && e->v.type != T_BUILTIN && !(init && is(init->v, e->v))) {
+					atom h = cons(nil, nil);
+					copy_push(todo, COPY_GLOBAL, x, NULL, h);
+					copy_push(todo, COPY_VALUE, e->v, &car(h), nil);
+				}
+			}
+			code = cdr(code);
+		}
+	}
+	vector_free(&pending);
+}
+
+/* Copies a, a value of context src, into the current context. Shared and
+ * cyclic structure is kept, and closures take along the globals they use.
+ * Continuations and threads cannot be copied. Works from an explicit
+ * stack, so deep structure does not use up the C stack of a worker. */
+static error copy_atom(struct arc_context *src, struct ptr_map *m, atom a, atom *result) {
+	struct copy_stack todo = { NULL, 0, 0 };
+	error err = ERROR_OK;
+	copy_push(&todo, COPY_VALUE, a, result, nil);
+	while (todo.size > 0 && !err) {
+		struct copy_task t = todo.tasks[--todo.size];
+		atom *seen = NULL, *to = t.to, last = nil;
+		if (t.kind == COPY_TABLE_ADD) {
+			table_add(t.from.value.table, car(t.holder), cdr(t.holder));
+			continue;
+		}
+		if (t.kind == COPY_GLOBAL) {
+			env_assign(ctx->env, make_sym(t.from.value.symbol).value.symbol, car(t.holder));
+			continue;
+		}
+		a = t.from;
+		switch (a.type) {
+		case T_SYM:
+			*to = make_sym(a.value.symbol);
+			break;
+		case T_STRING: {
+			char *v;
+			if ((seen = ptr_map_get(m, a.value.str))) {
+				*to = *seen;
+				break;
+			}
+			v = malloc(a.value.str->len + 1);
+			memcpy(v, a.value.str->value, a.value.str->len + 1);
+			*to = make_string_len(v, a.value.str->len);
+			ptr_map_put(m, a.value.str, *to);
+			break; }
+		case T_TABLE: {
+			struct arc_table *tb = a.value.table;
+			atom copy;
+			size_t i;
+			if ((seen = ptr_map_get(m, tb))) {
+				*to = *seen;
+				break;
+			}
+			if (tb->kind == TABLE_CACHE) copy = make_cache_table(((struct cache_table *)tb)->limit);
+			else if (tb->kind == TABLE_WEAK) copy = make_weak_table(tb->capacity);
+			else copy = make_table(tb->capacity);
+			*to = copy;
+			ptr_map_put(m, tb, copy);
+			for (i = 0; i < tb->capacity; i++) {
+				struct table_entry *e;
+				for (e = tb->data[i]; e; e = e->next) {
+					atom h = cons(nil, nil);
+					copy_push(&todo, COPY_TABLE_ADD, copy, NULL, h);
+					copy_push(&todo, COPY_VALUE, e->k, &car(h), nil);
+					copy_push(&todo, COPY_VALUE, e->v, &cdr(h), nil);
+				}
+			}
+			break; }
+		case T_CONS:
+		case T_CLOSURE:
+		case T_MACRO:
+			/* copy along the cdrs, leaving the cars to later steps */
+			while ((a.type == T_CONS || a.type == T_CLOSURE || a.type == T_MACRO)
+				&& !(seen = ptr_map_get(m, a.value.pair))) {
+				atom p = cons(nil, nil);
+				p.type = a.type;
+				ptr_map_put(m, a.value.pair, p);
+				if (no(last)) *to = p; else cdr(last) = p;
+				last = p;
+				copy_push(&todo, COPY_VALUE, car(a), &car(p), nil);
+				if (a.type != T_CONS) copy_globals(src, m, cdr(a), &todo);
 				a = cdr(a);
 			}
+			if (no(last)) *to = *seen;
+			else copy_push(&todo, COPY_VALUE, a, &cdr(last), nil);
+			break;
+		case T_INPUT:
+		case T_INPUT_PIPE:
+		case T_OUTPUT: /* shares the stream, which src closes */
+			if ((seen = ptr_map_get(m, a.value.port))) {
+				*to = *seen;
+				break;
+			}
+			*to = make_port(a.type, a.value.port->fp);
+			to->value.port->borrowed = 1;
+			if (!port_std(to->value.port)) ctx->open_ports--;
+			ptr_map_put(m, a.value.port, *to);
+			break;
+		case T_CONTINUATION:
+		case T_ESCAPE:
+		case T_THREAD:
+			err = ERROR_TYPE;
+			break;
+		default:
+			*to = a;
+		}
+	}
+	free(todo.tasks);
+	return err;
+}
+
+/* Binary serialization of data. Each value starts with a tag byte:
+ *   'n'                      nil
+ *   'i' zigzag varint        integral number other than -0
+ *   'd' 8 bytes              other number, IEEE double, little endian
+ *   'c' byte                 char
+ *   's' varint n, n bytes    string
+ *   'y' varint n, n bytes    symbol
+ *   'p' varint n, n values, value   list of n conses, then its tail
+ *   't' varint n, 2n values  table of n keys and values
+ *   'r' varint i             the i-th string, symbol, cons or table defined
+ *                            before, counting each cons of a list
+ * Varints are unsigned LEB128. Back references keep shared structure shared
+ * and cycles finite. Nesting is handled with explicit stacks. */
+
+static void put_varint(struct string *b, unsigned long long x) {
+	while (x >= 0x80) {
+		string_putc(b, (char)((x & 0x7f) | 0x80));
+		x >>= 7;
+	}
+	string_putc(b, (char)x);
+}
+
+static void put_bytes(struct string *b, const char *s, size_t n) {
+	put_varint(b, n);
+	if (b->len + n >= b->cap) {
+		while (b->len + n >= b->cap) b->cap *= 2;
+		b->str = realloc(b->str, b->cap);
+	}
+	memcpy(b->str + b->len, s, n);
+	b->len += n;
+}
+
+static int get_varint(FILE *fp, unsigned long long *x) {
+	int c, shift = 0;
+	*x = 0;
+	do {
+		if ((c = getc(fp)) == EOF || shift > 63) return 0;
+		*x |= (unsigned long long)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 1;
+}
+
+/* Appends the serialization of a to b, which string_new made */
+error marshal(struct string *b, atom a) {
+	struct arc_vector todo;
+	struct ptr_map seen; /* object -> its index */
+	size_t defined = 0;
+	error err = ERROR_OK;
+	vector_new(&todo);
+	ptr_map_new(&seen);
+	vector_add(&todo, a);
+	while (todo.size > 0 && !err) {
+		void *obj = NULL;
+		atom *ref;
+		a = todo.data[--todo.size];
+		switch (a.type) {
+		case T_CONS: obj = a.value.pair; break;
+		case T_STRING: obj = a.value.str; break;
+		case T_SYM: obj = a.value.symbol; break;
+		case T_TABLE: obj = a.value.table; break;
+		default: break;
+		}
+		if (obj && (ref = ptr_map_get(&seen, obj))) {
+			string_putc(b, 'r');
+			put_varint(b, (unsigned long long)ref->value.number);
+			continue;
+		}
+		if (obj && a.type != T_CONS) ptr_map_put(&seen, obj, make_number((double)defined++));
+		switch (a.type) {
+		case T_NIL:
+			string_putc(b, 'n');
+			break;
+		case T_NUM: {
+			double x = a.value.number;
+			if (x == floor(x) && fabs(x) < 9007199254740992.0 && !(x == 0 && signbit(x))) {
+				long long i = (long long)x;
+				string_putc(b, 'i');
+				put_varint(b, ((unsigned long long)i << 1) ^ (unsigned long long)(i >> 63));
+			}
+			else {
+				unsigned long long bits;
+				int k;
+				memcpy(&bits, &x, sizeof(bits));
+				string_putc(b, 'd');
+				for (k = 0; k < 8; k++) string_putc(b, (char)(bits >> (8 * k)));
+			}
+			break; }
+		case T_CHAR:
+			string_putc(b, 'c');
+			string_putc(b, a.value.ch);
+			break;
+		case T_STRING:
+			string_putc(b, 's');
+			put_bytes(b, a.value.str->value, a.value.str->len);
+			break;
+		case T_SYM:
+			string_putc(b, 'y');
+			put_bytes(b, a.value.symbol, strlen(a.value.symbol));
+			break;
+		case T_CONS: {
+			size_t n = 0, first = todo.size, i;
+			atom p;
+			/* the list ends at its tail or at a cons defined before */
+			for (p = a; p.type == T_CONS && !ptr_map_get(&seen, p.value.pair); p = cdr(p), n++)
+				ptr_map_put(&seen, p.value.pair, make_number((double)defined++));
+			string_putc(b, 'p');
+			put_varint(b, n);
+			/* the tail is written last, the elements in order before it */
+			vector_add(&todo, p);
+			for (i = 0, p = a; i < n; i++, p = cdr(p)) vector_add(&todo, car(p));
+			for (i = 0; i < n / 2; i++) {
+				atom t = todo.data[first + 1 + i];
+				todo.data[first + 1 + i] = todo.data[first + n - i];
+				todo.data[first + n - i] = t;
+			}
+			break; }
+		case T_TABLE: {
+			struct arc_table *t = a.value.table;
+			size_t i;
+			string_putc(b, 't');
+			put_varint(b, t->size);
+			for (i = 0; i < t->capacity; i++) {
+				struct table_entry *e;
+				for (e = t->data[i]; e; e = e->next) {
+					vector_add(&todo, e->v);
+					vector_add(&todo, e->k);
+				}
+			}
+			break; }
+		default: /* functions, ports, continuations and threads */
+			err = ERROR_TYPE;
+		}
+	}
+	ptr_map_free(&seen);
+	vector_free(&todo);
+	return err;
+}
+
+/* a list or table being read */
+struct unmarshal_frame {
+	atom obj;
+	atom next; /* list: cons whose car comes next, nil before the tail */
+	unsigned long long remaining; /* table: values still to read */
+	atom key;
+};
+
+/* reads a length and that many bytes, followed by a 0 in the result */
+static char *get_bytes(FILE *fp, size_t *len) {
+	unsigned long long n;
+	char *s;
+	if (!get_varint(fp, &n)) return NULL;
+	s = malloc(n + 1);
+	if (!s) return NULL;
+	if (fread(s, 1, n, fp) != n) {
+		free(s);
+		return NULL;
+	}
+	s[n] = 0;
+	*len = n;
+	return s;
+}
+
+/* Reads a value that marshal wrote. Returns ERROR_FILE at the end of fp. */
+error unmarshal_fp(FILE *fp, atom *result) {
+	struct unmarshal_frame *frames = NULL;
+	struct arc_vector defined;
+	size_t size = 0, capacity = 0, len;
+	unsigned long long n;
+	error err = ERROR_OK;
+	atom v;
+	char *s;
+	int c, k;
+	vector_new(&defined);
+	for (;;) {
+		switch (c = getc(fp)) {
+		case 'n':
+			v = nil;
+			break;
+		case 'i':
+			if (!get_varint(fp, &n)) goto eof;
+			v = make_number((double)(long long)((n >> 1) ^ (~(n & 1) + 1)));
+			break;
+		case 'd': {
+			unsigned long long bits = 0;
+			double x;
+			for (k = 0; k < 8; k++) {
+				if ((c = getc(fp)) == EOF) goto eof;
+				bits |= (unsigned long long)c << (8 * k);
+			}
+			memcpy(&x, &bits, sizeof(x));
+			v = make_number(x);
+			break; }
+		case 'c':
+			if ((c = getc(fp)) == EOF) goto eof;
+			v = make_char((char)c);
+			break;
+		case 's':
+			if (!(s = get_bytes(fp, &len))) goto eof;
+			v = make_string_len(s, len);
+			vector_add(&defined, v);
+			break;
+		case 'y':
+			if (!(s = get_bytes(fp, &len))) goto eof;
+			v = make_sym(s);
+			free(s);
+			vector_add(&defined, v);
+			break;
+		case 'r':
+			if (!get_varint(fp, &n)) goto eof;
+			if (n >= defined.size) {
+				err = ERROR_SYNTAX;
+				goto done;
+			}
+			v = defined.data[n];
+			break;
+		case 'p':
+		case 't':
+			if (!get_varint(fp, &n)) goto eof;
+			if (size == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				frames = realloc(frames, capacity * sizeof(*frames));
+			}
+			if (c == 'p') {
+				/* make all the conses first, then fill in their cars */
+				atom p = nil;
+				if (n == 0) {
+					err = ERROR_SYNTAX;
+					goto done;
+				}
+				for (; n > 0; n--) p = cons(nil, p);
+				frames[size].obj = frames[size].next = p;
+				for (; !no(p); p = cdr(p)) vector_add(&defined, p);
+			}
+			else {
+				frames[size].obj = make_table(n > 0 ? (size_t)n : 1);
+				frames[size].remaining = 2 * n;
+				vector_add(&defined, frames[size].obj);
+				if (n == 0) {
+					v = frames[size].obj;
+					break;
+				}
+			}
+			size++;
+			continue;
+		default:
+			if (c == EOF) goto eof;
+			err = ERROR_SYNTAX;
+			goto done;
+		}
+		/* give v to the innermost list or table, completing it perhaps */
+		while (size > 0) {
+			struct unmarshal_frame *f = &frames[size - 1];
+			if (f->obj.type == T_CONS) {
+				if (!no(f->next)) {
+					car(f->next) = v;
+					if (cdr(f->next).type == T_CONS) f->next = cdr(f->next);
+					else f->key = f->next, f->next = nil; /* key: last cons */
+					break;
+				}
+				/* v is the tail */
+				cdr(f->key) = v;
+			}
+			else {
+				if (--f->remaining % 2) {
+					f->key = v;
+					break;
+				}
+				table_add(f->obj.value.table, f->key, v);
+				if (f->remaining > 0) break;
+			}
+			v = f->obj;
+			size--;
+		}
+		if (size == 0) {
+			*result = v;
+			goto done;
+		}
+	}
+eof:
+	err = ERROR_FILE;
+done:
+	vector_free(&defined);
+	free(frames);
+	return err;
+}
+
+/* marshal x [output-port] */
+error builtin_marshal(struct arc_vector *vargs, atom *result) {
+	struct string b;
+	FILE *fp;
+	error err;
+	switch (vargs->size) {
+	case 1:
+		fp = stdout;
+		break;
+	case 2:
+		if ((err = port_fp(vargs->data[1], 0, &fp))) return err;
+		break;
+	default:
+		return ERROR_ARGS;
+	}
+	string_new(&b);
+	err = marshal(&b, vargs->data[0]);
+	if (!err) fwrite(b.str, 1, b.len, fp);
+	free(b.str);
+	*result = nil;
+	return err;
+}
+
+/* unmarshal [input-port [eof]] */
+error builtin_unmarshal(struct arc_vector *vargs, atom *result) {
+	FILE *fp = stdin;
+	int c;
+	if (vargs->size > 2) return ERROR_ARGS;
+	if (vargs->size > 0) {
+		error err = port_fp(vargs->data[0], 1, &fp);
+		if (err) return err;
+	}
+	if (thread_wait_input(fp)) return ERROR_RETRY;
+	if ((c = getc(fp)) == EOF) {
+		*result = vargs->size == 2 ? vargs->data[1] : nil;
+		return ERROR_OK;
+	}
+	ungetc(c, fp);
+	return unmarshal_fp(fp, result);
+}
+
+/* pmap, pkeep and preduce split a list into chunks that a pool of worker
+ * threads, each with an interpreter of its own, work on in parallel. The
+ * function and the chunks are copied into the workers' heaps and the results
+ * copied back, so the function must not depend on side effects. */
+enum pjob { PJ_MAP, PJ_KEEP, PJ_REDUCE };
+
+struct pool_chunk {
+	atom start; /* first cons of the chunk, in the caller's heap */
+	size_t count;
+	struct worker *worker;
+	atom result; /* in the worker's heap */
+	char *keep;  /* for pkeep, which elements to keep */
+	error err;
+};
+
+#ifndef _WIN32
+struct worker {
+	struct worker_pool *pool;
+	struct arc_context *ctx;
+	pthread_t thread;
+	size_t job; /* job whose function fn is */
+	atom fn;
+	int stack_base;
+};
+
+struct worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct worker *workers;
+	size_t worker_count;
+	int quit;
+	/* the job being run */
+	size_t job;
+	enum pjob kind;
+	struct arc_context *src;
+	atom fn;
+	struct pool_chunk *chunks;
+	size_t chunk_count, next_chunk, chunks_done;
+	int failed; /* a chunk failed, skip the rest; guarded by lock */
+};
+
+static int pool_failed(struct worker_pool *pool) {
+	int failed;
+	pthread_mutex_lock(&pool->lock);
+	failed = pool->failed;
+	pthread_mutex_unlock(&pool->lock);
+	return failed;
+}
+
+/* Runs one chunk of the pool's current job in the worker's context */
+static void chunk_run(struct worker *w, struct pool_chunk *c) {
+	struct worker_pool *pool = w->pool;
+	struct ptr_map m;
+	atom x, val, head = nil, last = nil, a = c->start;
+	size_t i;
+	int ss;
+	error err = ERROR_OK;
+	c->worker = w;
+	if (w->job != pool->job) { /* first chunk of this job for w */
+		w->job = pool->job;
+		ctx->stack_size = w->stack_base;
+		ptr_map_new(&m);
+		ptr_map_put(&m, pool->src->env.value.pair, ctx->env);
+		err = copy_atom(pool->src, &m, pool->fn, &w->fn);
+		ptr_map_free(&m);
+		if (err) w->job = 0;
+		else stack_add(w->fn);
+	}
+	ptr_map_new(&m);
+	ptr_map_put(&m, pool->src->env.value.pair, ctx->env);
+	if (pool->kind == PJ_KEEP) c->keep = malloc(c->count);
+	for (i = 0; i < c->count && !err && !pool_failed(pool); i++, a = cdr(a)) {
+		ss = ctx->stack_size;
+		err = copy_atom(pool->src, &m, car(a), &x);
+		if (err) break;
+		if (pool->kind == PJ_REDUCE && i == 0) {
+			val = x;
+		}
+		else if (pool->kind == PJ_REDUCE) {
+			atom args[2];
+			args[0] = head;
+			args[1] = x;
+			err = eval_apply(w->fn, args, 2, nil, &val);
+		}
+		else {
+			err = eval_apply(w->fn, &x, 1, nil, &val);
+		}
+		stack_restore(ss);
+		if (err) break;
+		switch (pool->kind) {
+		case PJ_MAP:
+			x = cons(val, nil);
+			if (no(head)) head = x; else cdr(last) = x;
+			last = x;
+			break;
+		case PJ_KEEP:
+			c->keep[i] = !no(val);
+			break;
+		case PJ_REDUCE:
+			head = val;
+			stack_add(head);
+			break;
+		}
+	}
+	ptr_map_free(&m);
+	c->result = head;
+	c->err = err;
+	if (err) {
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = 1;
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct worker *w = arg;
+	struct worker_pool *pool = w->pool;
+	w->ctx = arc_context_new();
+	arc_context_set(w->ctx);
+	ctx->worker = 1;
+	w->stack_base = ctx->stack_size;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->next_chunk >= pool->chunk_count)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->quit) break;
+		struct pool_chunk *c = &pool->chunks[pool->next_chunk++];
+		pthread_mutex_unlock(&pool->lock);
+		chunk_run(w, c);
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->chunks_done == pool->chunk_count)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* The pool has ARCADIA_WORKERS workers, by default one per processor */
+static struct worker_pool *pool_get() {
+	struct worker_pool *pool = ctx->pool;
+	size_t i, n;
+	if (pool) return pool;
+	char *workers = getenv("ARCADIA_WORKERS");
+	n = workers && atol(workers) > 0 ? atol(workers) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	pool = ctx->pool = calloc(1, sizeof(struct worker_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->worker_count = n;
+	if (n < 2) return pool; /* the caller does the work itself */
+	pool->workers = calloc(n, sizeof(struct worker));
+	for (i = 0; i < n; i++) {
+		pool->workers[i].pool = pool;
+		pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+	}
+	return pool;
+}
+
+void pool_free(struct worker_pool *pool) {
+	size_t i;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; pool->workers && i < pool->worker_count; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		arc_context_free(pool->workers[i].ctx);
+	}
+	free(pool->workers);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool);
+}
+#endif
+
+/* Runs a parallel job over list xs, which has n elements, and puts the
+ * results in chunks[0..*count) in the current context. Returns nonzero if
+ * the job had to be run here instead. */
+static error pjob_run(enum pjob kind, atom fn, atom xs, size_t n, struct pool_chunk **chunks, size_t *count) {
+	*chunks = NULL;
+	*count = 0;
+#ifndef _WIN32
+	struct worker_pool *pool;
+	struct ptr_map m;
+	size_t i, k, per;
+	error err = ERROR_OK;
+	if (ctx->worker || n < 2 || (pool = pool_get())->worker_count < 2)
+		return ERROR_RETRY;
+	/* a few chunks per worker even out their loads */
+	k = pool->worker_count * 4;
+	if (k > n) k = n;
+	per = (n + k - 1) / k;
+	k = (n + per - 1) / per;
+	*chunks = calloc(k, sizeof(struct pool_chunk));
+	for (i = 0; i < k; i++) {
+		(*chunks)[i].start = xs;
+		(*chunks)[i].count = i < k - 1 ? per : n - per * (k - 1);
+		size_t j;
+		for (j = 0; j < (*chunks)[i].count; j++) xs = cdr(xs);
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->job++;
+	pool->kind = kind;
+	pool->src = ctx;
+	pool->fn = fn;
+	pool->chunks = *chunks;
+	pool->chunk_count = k;
+	pool->next_chunk = pool->chunks_done = 0;
+	pool->failed = 0;
+	pthread_cond_broadcast(&pool->work);
+	while (pool->chunks_done < k)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->chunk_count = 0;
+	pthread_mutex_unlock(&pool->lock);
+	*count = k;
+	/* the workers are idle now; bring the results over */
+	for (i = 0; i < k; i++) {
+		struct pool_chunk *c = &(*chunks)[i];
+		if (c->err) {
+			err = c->err;
+			break;
+		}
+		if (kind == PJ_KEEP) continue;
+		ptr_map_new(&m);
+		ptr_map_put(&m, c->worker->ctx->env.value.pair, ctx->env);
+		err = copy_atom(c->worker->ctx, &m, c->result, &c->result);
+		ptr_map_free(&m);
+		if (err) break;
+	}
+	return err;
+#else
+	return ERROR_RETRY;
+#endif
+}
+
+static void pjob_free(struct pool_chunk *chunks, size_t count) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		free(chunks[i].keep);
+	}
+	free(chunks);
+}
+
+/* checks (f xs) arguments and counts xs */
+static error pjob_args(struct arc_vector *vargs, size_t *n) {
+	if (vargs->size != 2) return ERROR_ARGS;
+	atom xs = vargs->data[1];
+	if (!listp(xs)) return ERROR_TYPE;
+	*n = len(xs);
+	return ERROR_OK;
+}
+
+/* pmap f list
+ * Like map1, with the calls spread over the worker threads. */
+error builtin_pmap(struct arc_vector *vargs, atom *result) {
+	struct pool_chunk *chunks;
+	size_t n, count, i;
+	atom fn, xs, last = nil;
+	error err = pjob_args(vargs, &n);
+	if (err) return err;
+	fn = vargs->data[0];
+	xs = vargs->data[1];
+	err = pjob_run(PJ_MAP, fn, xs, n, &chunks, &count);
+	*result = nil;
+	if (err == ERROR_RETRY) { /* sequentially */
+		for (; !no(xs); xs = cdr(xs)) {
+			atom val, p;
+			err = eval_apply(fn, &car(xs), 1, nil, &val);
+			if (err) return err;
+			p = cons(val, nil);
+			if (no(*result)) *result = p; else cdr(last) = p;
+			last = p;
+		}
+		return ERROR_OK;
+	}
+	/* join the chunks' lists */
+	for (i = 0; i < count && !err; i++) {
+		atom p = chunks[i].result;
+		if (no(p)) continue;
+		if (no(*result)) *result = p; else cdr(last) = p;
+		for (last = p; !no(cdr(last)); last = cdr(last)) {
+		}
+	}
+	pjob_free(chunks, count);
+	return err;
+}
+
+/* pkeep f list
+ * Like keep with a function, testing the elements on the worker threads. */
+error builtin_pkeep(struct arc_vector *vargs, atom *result) {
+	struct pool_chunk *chunks;
+	size_t n, count, i = 0, j = 0;
+	atom fn, xs, last = nil;
+	error err = pjob_args(vargs, &n);
+	if (err) return err;
+	fn = vargs->data[0];
+	xs = vargs->data[1];
+	err = pjob_run(PJ_KEEP, fn, xs, n, &chunks, &count);
+	*result = nil;
+	for (; !no(xs) && (!err || err == ERROR_RETRY); xs = cdr(xs), j++) {
+		int keep;
+		if (err == ERROR_RETRY) { /* sequentially */
+			atom val;
+			error e = eval_apply(fn, &car(xs), 1, nil, &val);
+			if (e) return e;
+			keep = !no(val);
+		}
+		else {
+			if (j == chunks[i].count) {
+				i++;
+				j = 0;
+			}
+			keep = chunks[i].keep[j];
+		}
+		if (keep) {
+			atom p = cons(car(xs), nil);
+			if (no(*result)) *result = p; else cdr(last) = p;
+			last = p;
+		}
+	}
+	pjob_free(chunks, count);
+	return err == ERROR_RETRY ? ERROR_OK : err;
+}
+
+/* preduce f list
+ * Like reduce, but folds chunks of the list on the worker threads and then
+ * their results in order, so f must be associative. */
+error builtin_preduce(struct arc_vector *vargs, atom *result) {
+	struct pool_chunk *chunks;
+	size_t n, count, i;
+	atom fn, xs, acc;
+	error err = pjob_args(vargs, &n);
+	if (err) return err;
+	fn = vargs->data[0];
+	xs = vargs->data[1];
+	if (n < 2) /* as reduce does */
+		return eval_apply(fn, NULL, 0, xs, result);
+	err = pjob_run(PJ_REDUCE, fn, xs, n, &chunks, &count);
+	if (err == ERROR_RETRY) { /* sequentially */
+		acc = car(xs);
+		for (xs = cdr(xs); !no(xs); xs = cdr(xs)) {
+			atom args[2];
+			args[0] = acc;
+			args[1] = car(xs);
+			err = eval_apply(fn, args, 2, nil, &acc);
+			if (err) return err;
+		}
+		*result = acc;
+		return ERROR_OK;
+	}
+	acc = count ? chunks[0].result : nil;
+	for (i = 1; i < count && !err; i++) {
+		atom args[2];
+		args[0] = acc;
+		args[1] = chunks[i].result;
+		err = eval_apply(fn, args, 2, nil, &acc);
+	}
+	pjob_free(chunks, count);
+	*result = acc;
+	return err;
+}
+
+#ifndef _WIN32
+/* gives a fork-pool child the index of its next element */
+/* Fails, with SIGPIPE ignored, if the child has gone */
+static error fork_send(FILE *fp, size_t job) {
+	struct string b;
+	int ok;
+	string_new(&b);
+	put_varint(&b, job);
+	ok = fwrite(b.str, 1, b.len, fp) == b.len && fflush(fp) == 0;
+	free(b.str);
+	return ok ? ERROR_OK : ERROR_FILE;
+}
+
+/* Waits for a child that went away without its result, and says how */
+static error fork_lost(pid_t *pid) {
+	int status;
+	if (waitpid(*pid, &status, 0) < 0) return ERROR_FILE;
+	*pid = 0;
+	if (WIFEXITED(status))
+		printf("fork-pool: a worker exited with status %d\n", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		printf("fork-pool: a worker was killed by signal %d\n", WTERMSIG(status));
+	else return ERROR_FILE;
+	ctx->cur_expr = nil;
+	return ERROR_USER;
+}
+#endif
+
+/* fork-pool n f list
+ * Like map1, with the calls spread over n forked copies of the interpreter.
+ * The children inherit f and the list when forked; the parent hands them the
+ * indexes of the elements to work on and they send back marshaled results,
+ * so the results must be data, not functions or ports. */
+error builtin_fork_pool(struct arc_vector *vargs, atom *result) {
+	struct arc_vector items;
+	atom fn, xs, last = nil;
+	size_t count, workers, i;
+	error err = ERROR_OK;
+	if (vargs->size != 3) return ERROR_ARGS;
+	if (vargs->data[0].type != T_NUM || !listp(vargs->data[2])) return ERROR_TYPE;
+	fn = vargs->data[1];
+	vector_new(&items);
+	for (xs = vargs->data[2]; !no(xs); xs = cdr(xs)) vector_add(&items, car(xs));
+	count = items.size;
+	workers = vargs->data[0].value.number < 1 ? 1 : (size_t)vargs->data[0].value.number;
+	if (workers > count) workers = count;
+	*result = nil;
+#ifndef _WIN32
+	if (count > 0) {
+		struct fork_child { pid_t pid; FILE *to, *from; size_t job; } *ch;
+		struct pollfd *fds;
+		struct sigaction ign, old_pipe;
+		atom *vals = calloc(count, sizeof(atom));
+		size_t next = 0, busy = 0;
+		ch = calloc(workers, sizeof(*ch));
+		fds = calloc(workers, sizeof(*fds));
+		/* a write to a child that died fails instead of killing us */
+		memset(&ign, 0, sizeof(ign));
+		ign.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &ign, &old_pipe);
+		fflush(NULL); /* or the children would write out the buffers again */
+		for (i = 0; i < workers; i++) {
+			int down[2], up[2];
+			size_t k;
+			if (pipe(down)) break;
+			if (pipe(up)) {
+				close(down[0]);
+				close(down[1]);
+				break;
+			}
+			ch[i].pid = fork();
+			if (ch[i].pid == 0) {
+				FILE *in = fdopen(down[0], "rb"), *out = fdopen(up[1], "wb");
+				unsigned long long job;
+				close(down[1]);
+				close(up[0]);
+				sigaction(SIGPIPE, &old_pipe, NULL);
+				for (k = 0; k < i; k++) {
+					fclose(ch[k].to);
+					fclose(ch[k].from);
+				}
+				ctx->worker = 1; /* the pool's threads did not come along */
+				while (get_varint(in, &job) && job < count) {
+					atom val;
+					int ss = ctx->stack_size;
+					error e = eval_apply(fn, &items.data[job], 1, nil, &val);
+					struct string b;
+					string_new(&b);
+					if (!e) e = marshal(&b, val);
+					if (e) {
+						b.len = 0;
+						put_varint(&b, e);
+					}
+					else putc(0, out);
+					fwrite(b.str, 1, b.len, out);
+					free(b.str);
+					fflush(out);
+					ctx->stack_size = ss;
+				}
+				fflush(NULL);
+				_exit(0);
+			}
+			close(down[0]);
+			close(up[1]);
+			if (ch[i].pid < 0) {
+				close(down[1]);
+				close(up[0]);
+				break;
+			}
+			ch[i].to = fdopen(down[1], "wb");
+			ch[i].from = fdopen(up[0], "rb");
+		}
+		workers = i;
+		if (workers == 0) err = ERROR_FILE;
+		for (i = 0; i < workers && next < count && !err; i++, busy++) {
+			ch[i].job = next++;
+			if (fork_send(ch[i].to, ch[i].job)) err = fork_lost(&ch[i].pid);
+		}
+		while (busy > 0 && !err) {
+			for (i = 0; i < workers; i++) {
+				fds[i].fd = ch[i].to ? fileno(ch[i].from) : -1; /* -1: done */
+				fds[i].events = POLLIN;
+				fds[i].revents = 0;
+			}
+			if (poll(fds, workers, -1) < 0) continue;
+			for (i = 0; i < workers && !err; i++) {
+				unsigned long long e;
+				if (!(fds[i].revents & (POLLIN | POLLHUP))) continue;
+				busy--;
+				if (!get_varint(ch[i].from, &e)) err = fork_lost(&ch[i].pid);
+				else if (e) err = (error)e;
+				else err = unmarshal_fp(ch[i].from, &vals[ch[i].job]);
+				if (err) break;
+				if (next < count) {
+					ch[i].job = next++;
+					if (fork_send(ch[i].to, ch[i].job)) err = fork_lost(&ch[i].pid);
+					busy++;
+				}
+				else {
+					fclose(ch[i].to); /* no more work, the child exits */
+					ch[i].to = NULL;
+				}
+			}
+		}
+		/* Closing the pipes ends the children. After an error, one still working
+		 * first finishes its job, then exits when it reads the end of its input
+		 * or dies of SIGPIPE writing the result; waitpid waits for that. */
+		for (i = 0; i < workers; i++) {
+			if (ch[i].to) fclose(ch[i].to);
+			fclose(ch[i].from);
+			if (ch[i].pid > 0) waitpid(ch[i].pid, NULL, 0);
+		}
+		sigaction(SIGPIPE, &old_pipe, NULL);
+		for (i = 0; i < count && !err; i++) {
+			atom p = cons(vals[i], nil);
+			if (no(*result)) *result = p; else cdr(last) = p;
+			last = p;
+		}
+		free(vals);
+		free(fds);
+		free(ch);
+		vector_free(&items);
+		return err;
+	}
+#endif
+	for (i = 0; i < count && !err; i++) { /* sequentially */
+		atom val, p;
+		err = eval_apply(fn, &items.data[i], 1, nil, &val);
+		if (err) break;
+		p = cons(val, nil);
+		if (no(*result)) *result = p; else cdr(last) = p;
+		last = p;
+	}
+	vector_free(&items);
+	return err;
+}
+
+/* profile-start
+ * Starts counting the calls and time of each function, from zero. */
+error builtin_profile_start(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	profile_start();
+	*result = nil;
+	return ERROR_OK;
+}
+
+/* Writes a report to the output port or path of vargs, stderr by default */
+static error report_to(struct arc_vector *vargs, void (*report)(FILE *fp)) {
+	FILE *fp = stderr;
+	if (vargs->size > 1) return ERROR_ARGS;
+	if (vargs->size == 1) {
+		atom a = vargs->data[0];
+		if (a.type == T_OUTPUT) {
+			error err = port_fp(a, 0, &fp);
+			if (err) return err;
+		}
+		else if (a.type == T_STRING) {
+			if (!(fp = fopen(a.value.str->value, "w"))) return ERROR_FILE;
+		}
+		else return ERROR_TYPE;
+	}
+	report(fp);
+	if (vargs->size == 1 && vargs->data[0].type == T_STRING) fclose(fp);
+	return ERROR_OK;
+}
+
+/* profile-report [output-port-or-path]
+ * Prints the calls, total time and self time of each function, most
+ * self time first, to stderr by default. */
+error builtin_profile_report(struct arc_vector *vargs, atom *result) {
+	*result = nil;
+	return report_to(vargs, profile_report);
+}
+
+/* profile-sample [interval]
+ * Starts sampling the stack of functions being called every interval
+ * seconds of CPU time (default 0.01), from no samples. An interval of 0
+ * stops sampling. The timer is per process, so it is an error while another
+ * interpreter, e.g. a pmap worker or another embedded context, samples. */
+error builtin_profile_sample(struct arc_vector *vargs, atom *result) {
+	double interval = 0.01;
+	if (vargs->size > 1) return ERROR_ARGS;
+	if (vargs->size == 1) {
+		if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+		interval = vargs->data[0].value.number;
+		if (interval < 0) return ERROR_ARGS;
+	}
+	if (interval > 0) {
+		if (sample_start(interval)) {
+			puts("profile-sample: another interpreter of this process is sampling");
+			ctx->cur_expr = nil;
+			return ERROR_USER;
+		}
+	}
+	else sample_stop();
+	*result = nil;
+	return ERROR_OK;
+}
+
+/* profile-folded [output-port-or-path]
+ * Writes the samples as folded stacks, the input of flamegraph.pl, to
+ * stderr by default. */
+error builtin_profile_folded(struct arc_vector *vargs, atom *result) {
+	*result = nil;
+	return report_to(vargs, sample_report);
+}
+
+/* profile-alloc [every]
+ * Starts recording which forms allocate pairs, strings and tables, from
+ * none, sampling one allocation in every (default 16). An every of 0
+ * stops recording; the report still shows what was recorded. */
+error builtin_profile_alloc(struct arc_vector *vargs, atom *result) {
+	double every = 16;
+	if (vargs->size > 1) return ERROR_ARGS;
+	if (vargs->size == 1) {
+		if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+		every = vargs->data[0].value.number;
+		if (every < 0) return ERROR_ARGS;
+	}
+	alloc_profile_start((unsigned long)every);
+	*result = nil;
+	return ERROR_OK;
+}
+
+/* profile-alloc-report [output-port-or-path]
+ * Prints the estimated objects and bytes allocated by each form, most
+ * bytes first, to stderr by default. */
+error builtin_profile_alloc_report(struct arc_vector *vargs, atom *result) {
+	*result = nil;
+	return report_to(vargs, alloc_profile_report);
+}
+
+/* gc-stats
+ * Returns a table of what the collector has done: collections, pause-total
+ * and pause-max in seconds, the pairs, strings and tables found live by the
+ * last collection with their bytes, the objects allocated so far and per
+ * second, the number of symbols and the size of the root stack. */
+error builtin_gc_stats(struct arc_vector *vargs, atom *result) {
+	struct gc_stats *st = &ctx->gc_stats;
+	size_t allocated = st->allocated + ctx->alloc_count - ctx->alloc_count_old;
+	double elapsed = now_seconds() - ctx->start_time;
+	struct arc_table *t;
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_table(32);
+	t = result->value.table;
+	table_set_sym(t, make_sym("collections").value.symbol, make_number(st->collections));
+	table_set_sym(t, make_sym("pause-total").value.symbol, make_number(st->pause_total));
+	table_set_sym(t, make_sym("pause-max").value.symbol, make_number(st->pause_max));
+	table_set_sym(t, make_sym("pairs").value.symbol, make_number(st->pairs));
+	table_set_sym(t, make_sym("pair-bytes").value.symbol, make_number(st->pairs * sizeof(struct arc_pair)));
+	table_set_sym(t, make_sym("strings").value.symbol, make_number(st->strings));
+	table_set_sym(t, make_sym("string-bytes").value.symbol, make_number(st->string_bytes));
+	table_set_sym(t, make_sym("tables").value.symbol, make_number(st->tables));
+	table_set_sym(t, make_sym("table-bytes").value.symbol, make_number(st->table_bytes));
+	table_set_sym(t, make_sym("allocated").value.symbol, make_number(allocated));
+	table_set_sym(t, make_sym("alloc-rate").value.symbol, make_number(elapsed > 0 ? allocated / elapsed : 0));
+	table_set_sym(t, make_sym("symbols").value.symbol, make_number(ctx->symbol_size));
+	table_set_sym(t, make_sym("stack").value.symbol, make_number(ctx->stack_size));
+	table_set_sym(t, make_sym("stack-capacity").value.symbol, make_number(ctx->stack_capacity));
+	return ERROR_OK;
+}
+
+/* open-ports
+ * Returns the number of ports opened and not yet closed, explicitly or by
+ * gc, besides stdin, stdout and stderr. */
+error builtin_open_ports(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = make_number((double)ctx->open_ports);
+	return ERROR_OK;
+}
+
+/* vm-stats
+ * Returns a table of counts of what the evaluator did, or nil unless
+ * built with -DARC_STATS. */
+error builtin_vm_stats(struct arc_vector *vargs, atom *result) {
+	if (vargs->size != 0) return ERROR_ARGS;
+	*result = nil;
+#ifdef ARC_STATS
+	{
+		struct vm_stats *st = &ctx->vm_stats;
+		struct arc_table *t;
+		*result = make_table(32);
+		t = result->value.table;
+		table_set_sym(t, make_sym("evals").value.symbol, make_number(st->evals));
+		table_set_sym(t, make_sym("evals-symbol").value.symbol, make_number(st->evals_symbol));
+		table_set_sym(t, make_sym("evals-self").value.symbol, make_number(st->evals_self));
+		table_set_sym(t, make_sym("evals-form").value.symbol, make_number(st->evals_form));
+		table_set_sym(t, make_sym("if").value.symbol, make_number(st->sf_if));
+		table_set_sym(t, make_sym("assign").value.symbol, make_number(st->sf_assign));
+		table_set_sym(t, make_sym("quote").value.symbol, make_number(st->sf_quote));
+		table_set_sym(t, make_sym("fn").value.symbol, make_number(st->sf_fn));
+		table_set_sym(t, make_sym("do").value.symbol, make_number(st->sf_do));
+		table_set_sym(t, make_sym("mac").value.symbol, make_number(st->sf_mac));
+		table_set_sym(t, make_sym("builtin-calls").value.symbol, make_number(st->builtin_calls));
+		table_set_sym(t, make_sym("closure-calls").value.symbol, make_number(st->closure_calls));
+		table_set_sym(t, make_sym("tail-calls").value.symbol, make_number(st->tail_calls));
+		table_set_sym(t, make_sym("env-gets").value.symbol, make_number(st->env_gets));
+		table_set_sym(t, make_sym("env-scopes").value.symbol, make_number(st->env_scopes));
+		table_set_sym(t, make_sym("table-gets").value.symbol, make_number(st->table_gets));
+		table_set_sym(t, make_sym("table-probes").value.symbol, make_number(st->table_probes));
+		table_set_sym(t, make_sym("vector-spills").value.symbol, make_number(st->vector_spills));
+	}
+#endif
+	return ERROR_OK;
+}
+
+/* end builtin */
+
+void string_new(struct string *dst) {
+	dst->len = 0;
+	dst->cap = 2;
+	dst->str = malloc(dst->cap * sizeof(char));
+	dst->str[0] = 0;
+}
+
+void string_putc(struct string *dst, char c) {
+	if (dst->len + 1 >= dst->cap) {
+		dst->cap *= 2;
+		dst->str = realloc(dst->str, dst->cap * sizeof(char));
+	}
+	dst->str[dst->len++] = c;
+	dst->str[dst->len] = 0;
+}
+
+void string_cat(struct string* dst, char* src) {
+	string_cat_len(dst, src, strlen(src));
+}
+
+/* appends n bytes of src, which may include 0 bytes */
+void string_cat_len(struct string *dst, const char *src, size_t n) {
+	size_t len = dst->len + n;
+	
+	if (len + 1 > dst->cap) {		
+		while (len + 1 > dst->cap) {
+			dst->cap *= 2;
+		}
+		dst->str = realloc(dst->str, dst->cap * sizeof(char));
+	}
+	
+	memcpy(dst->str + dst->len, src, n);
+	dst->str[len] = 0;
+	dst->len = len;
+}
+
+/* pending work of to_string_cat */
+struct print_item {
+	enum { PRINT_ATOM, PRINT_REST, PRINT_TEXT } kind;
+	atom a; /* PRINT_ATOM: value, PRINT_REST: remaining list */
+	const char *text;
+};
+
+static void print_push(struct print_item **items, size_t *size, size_t *capacity, int kind, atom a, const char *text) {
+	if (*size == *capacity) {
+		*capacity *= 2;
+		*items = realloc(*items, *capacity * sizeof(struct print_item));
+	}
+	(*items)[*size].kind = kind;
+	(*items)[*size].a = a;
+	(*items)[*size].text = text;
+	(*size)++;
+}
+
+/* Appends the printed representation of a to s. Nesting is handled with an
+ * explicit stack of pending items rather than recursion. */
+void to_string_cat(struct string *s, atom a, int write) {
+	size_t size = 0, capacity = 16;
+	struct print_item *items = malloc(capacity * sizeof(struct print_item));
+	char buf[80];
+
+	print_push(&items, &size, &capacity, PRINT_ATOM, a, NULL);
+	while (size > 0) {
+		struct print_item it = items[--size];
+		if (it.kind == PRINT_TEXT) {
+			string_cat(s, (char *)it.text);
+			continue;
+		}
+		a = it.a;
+		if (it.kind == PRINT_REST) { /* inside a list, after its first element */
+			if (no(a)) {
+				string_cat(s, ")");
+			}
+			else if (a.type == T_CONS) {
+				string_cat(s, " ");
+				print_push(&items, &size, &capacity, PRINT_REST, cdr(a), NULL);
+				print_push(&items, &size, &capacity, PRINT_ATOM, car(a), NULL);
+			}
 			else {
-				r += hash_code(a);
-				break;
+				string_cat(s, " . ");
+				print_push(&items, &size, &capacity, PRINT_REST, nil, NULL);
+				print_push(&items, &size, &capacity, PRINT_ATOM, a, NULL);
+			}
+			continue;
+		}
+		switch (a.type) {
+		case T_NIL:
+			string_cat(s, "nil");
+			break;
+		case T_CONS: {
+			const char *prefix = NULL;
+			if (cdr(a).type == T_CONS && no(cdr(cdr(a)))) { /* (quote x) => 'x */
+				if (is(car(a), ctx->sym_quote)) prefix = "'";
+				else if (is(car(a), ctx->sym_quasiquote)) prefix = "`";
+				else if (is(car(a), ctx->sym_unquote)) prefix = ",";
+				else if (is(car(a), ctx->sym_unquote_splicing)) prefix = ",@";
+			}
+			if (prefix) {
+				string_cat(s, (char *)prefix);
+				print_push(&items, &size, &capacity, PRINT_ATOM, car(cdr(a)), NULL);
+			}
+			else {
+				string_cat(s, "(");
+				print_push(&items, &size, &capacity, PRINT_REST, cdr(a), NULL);
+				print_push(&items, &size, &capacity, PRINT_ATOM, car(a), NULL);
+			}
+			break; }
+		case T_SYM:
+			string_cat(s, a.value.symbol);
+			break;
+		case T_STRING:
+			if (write) string_cat(s, "\"");
+			string_cat_len(s, a.value.str->value, a.value.str->len);
+			if (write) string_cat(s, "\"");
+			break;
+		case T_NUM:
+			sprintf(buf, "%.16g", a.value.number);
+			string_cat(s, buf);
+			break;
+		case T_BUILTIN:
+			sprintf(buf, "#<builtin:%p>", a.value.builtin);
+			string_cat(s, buf);
+			break;
+		case T_CLOSURE: /* printed as (fn . body) */
+			string_cat(s, "(fn");
+			print_push(&items, &size, &capacity, PRINT_REST, cdr(a), NULL);
+			break;
+		case T_MACRO:
+			string_cat(s, "#<macro:");
+			print_push(&items, &size, &capacity, PRINT_TEXT, nil, ">");
+			print_push(&items, &size, &capacity, PRINT_ATOM, cdr(a), NULL);
+			break;
+		case T_INPUT:
+			string_cat(s, "#<input>");
+			break;
+		case T_INPUT_PIPE:
+			string_cat(s, "#<input-pipe>");
+			break;
+		case T_OUTPUT:
+			string_cat(s, "#<output>");
+			break;
+		case T_TABLE: {
+			string_cat(s, "#<table:");
+			print_push(&items, &size, &capacity, PRINT_TEXT, nil, ">");
+			size_t i, mark = size;
+			for (i = 0; i < a.value.table->capacity; i++) {
+				struct table_entry *p;
+				for (p = a.value.table->data[i]; p; p = p->next) {
+					print_push(&items, &size, &capacity, PRINT_TEXT, nil, " ");
+					print_push(&items, &size, &capacity, PRINT_ATOM, p->k, NULL);
+					print_push(&items, &size, &capacity, PRINT_TEXT, nil, ":");
+					print_push(&items, &size, &capacity, PRINT_ATOM, p->v, NULL);
+				}
+			}
+			/* reverse so that the entries pop in the order they were pushed */
+			size_t lo = mark, hi = size;
+			while (lo + 1 < hi) {
+				struct print_item t = items[lo];
+				items[lo++] = items[--hi];
+				items[hi] = t;
 			}
+			break; }
+		case T_CHAR:
+			if (write) {
+				string_cat(s, "#\\");
+				switch (a.value.ch) {
+				case '\0': string_cat(s, "nul"); break;
+				case '\r': string_cat(s, "return"); break;
+				case '\n': string_cat(s, "newline"); break;
+				case '\t': string_cat(s, "tab"); break;
+				case ' ': string_cat(s, "space"); break;
+				default:
+					buf[0] = a.value.ch;
+					buf[1] = '\0';
+					string_cat(s, buf);
+				}
+			}
+			else {
+				string_putc(s, a.value.ch); /* #\nul too */
+			}
+			break;
+		case T_CONTINUATION:
+		case T_ESCAPE:
+			string_cat(s, "#<continuation>");
+			break;
+		case T_THREAD:
+			string_cat(s, "#<thread>");
+			break;
+		default:
+			string_cat(s, "#<unknown type>");
+			break;
 		}
-		return r;
+	}
+	free(items);
+}
+
+char *to_string(atom a, int write) {
+	struct string s;
+	string_new(&s);
+	to_string_cat(&s, a, write);
+	s.str = realloc(s.str, s.len + 1);
+	return s.str;
+}
+
+size_t hash_code_sym(char *s) {
+	return (size_t)s / sizeof(s) / 2;
+}
+
+size_t hash_code_atom(atom a) {
+	size_t r = 1;
+	switch (a.type) {
+	case T_NIL:
+		return 0;
 	case T_SYM:
 		return hash_code_sym(a.value.symbol);
 	case T_STRING: {
-		char *v = a.value.str->value;
-		for (; *v != 0; v++) {
+		char *v = a.value.str->value, *end = v + a.value.str->len;
+		for (; v < end; v++) {
 			r *= 31;
 			r += *v;
 		}
@@ -2199,24 +4611,57 @@ size_t hash_code(atom a) {
 		return (size_t)((void*)a.value.symbol) + (size_t)a.value.number;
 	case T_BUILTIN:
 		return (size_t)a.value.builtin;
-	case T_CLOSURE:
-		return hash_code(cdr(a));
-	case T_MACRO:
-		return hash_code(cdr(a));
 	case T_INPUT:
 	case T_INPUT_PIPE:
 	case T_OUTPUT:
-		return (size_t)a.value.fp / sizeof(*a.value.fp);
+		return (size_t)a.value.port / sizeof(*a.value.port);
 	default:
 		return 0;
 	}
 }
 
-atom make_table(size_t capacity) {
+/* Conses are hashed by structure, so that iso keys collide. Nested lists are
+ * deferred to an explicit stack instead of recursing. */
+size_t hash_code(atom a) {
+	if (a.type == T_CLOSURE || a.type == T_MACRO)
+		a = cdr(a);
+	if (a.type != T_CONS)
+		return hash_code_atom(a);
+
+	size_t r = 1;
+	struct arc_vector pending;
+	vector_new(&pending);
+	vector_add(&pending, a);
+	while (pending.size > 0) {
+		a = pending.data[--pending.size];
+		while (a.type == T_CONS) {
+			atom x = car(a);
+			r *= 31;
+			if (x.type == T_CLOSURE || x.type == T_MACRO)
+				x = cdr(x);
+			if (x.type == T_CONS)
+				vector_add(&pending, x);
+			else
+				r += hash_code_atom(x);
+			a = cdr(a);
+		}
+		if (!no(a)) {
+			r = r * 31 + hash_code_atom(a);
+		}
+	}
+	vector_free(&pending);
+	return r;
+}
+
+/* bytes is the size of the struct, which begins with a struct arc_table */
+static atom table_new(size_t bytes, size_t capacity) {
 	atom a;
-	struct table *s;
-	alloc_count++;
-	s = a.value.table = malloc(sizeof(struct table));
+	struct arc_table *s;
+	ctx->alloc_count++;
+	if (ctx->alloc_sample && --ctx->alloc_countdown == 0)
+		alloc_record(bytes + capacity * sizeof(struct table_entry *));
+	s = a.value.table = malloc(bytes);
+	s->kind = TABLE_PLAIN;
 	s->capacity = capacity;
 	s->size = 0;
 	s->data = malloc(capacity * sizeof(struct table_entry *));
@@ -2225,14 +4670,63 @@ atom make_table(size_t capacity) {
 		s->data[i] = NULL;
 	}
 	s->mark = 0;
-	s->next = table_head;
-	table_head = s;
+	s->next = ctx->table_head;
+	ctx->table_head = s;
 	a.value.table = s;
 	a.type = T_TABLE;
 	stack_add(a);
 	return a;
 }
 
+atom make_table(size_t capacity) {
+	return table_new(sizeof(struct arc_table), capacity);
+}
+
+atom make_weak_table(size_t capacity) {
+	atom a = table_new(sizeof(struct arc_table), capacity);
+	a.value.table->kind = TABLE_WEAK;
+	return a;
+}
+
+atom make_cache_table(size_t limit) {
+	atom a = table_new(sizeof(struct cache_table), 8);
+	struct cache_table *c = (struct cache_table *)a.value.table;
+	c->t.kind = TABLE_CACHE;
+	c->limit = limit;
+	c->newest = c->oldest = NULL;
+	return a;
+}
+
+static void lru_unlink(struct cache_table *c, struct lru_entry *e) {
+	if (e->newer) e->newer->older = e->older;
+	else c->newest = e->older;
+	if (e->older) e->older->newer = e->newer;
+	else c->oldest = e->newer;
+}
+
+static void lru_push(struct cache_table *c, struct lru_entry *e) {
+	e->newer = NULL;
+	e->older = c->newest;
+	if (c->newest) c->newest->newer = e;
+	else c->oldest = e;
+	c->newest = e;
+}
+
+/* Removes the least recently used entry of c */
+static void lru_evict(struct cache_table *c) {
+	struct lru_entry *e = c->oldest;
+	size_t i = hash_code(e->e.k) % c->t.capacity;
+	struct table_entry **p = &c->t.data[i];
+	while (*p != &e->e) {
+		if (*p) p = &(*p)->next;
+		else p = &c->t.data[i = (i + 1) % c->t.capacity]; /* the key was modified */
+	}
+	*p = e->e.next;
+	lru_unlink(c, e);
+	free(e);
+	c->t.size--;
+}
+
 struct table_entry *table_entry_new(atom k, atom v, struct table_entry *next) {
 	struct table_entry *r = malloc(sizeof(*r));
 	r->k = k;
@@ -2243,7 +4737,7 @@ struct table_entry *table_entry_new(atom k, atom v, struct table_entry *next) {
 
 
 /* return 1 if found */
-int table_set(struct table *tbl, atom k, atom v) {
+int table_set(struct arc_table *tbl, atom k, atom v) {
 	struct table_entry *p = table_get(tbl, k);
 	if (p) {
 		p->v = v;
@@ -2256,7 +4750,7 @@ int table_set(struct table *tbl, atom k, atom v) {
 }
 
 /* return 1 if found. k is symbol. */
-int table_set_sym(struct table *tbl, char *k, atom v) {
+int table_set_sym(struct arc_table *tbl, char *k, atom v) {
 	struct table_entry *p = table_get_sym(tbl, k);
 	if (p) {
 		p->v = v;
@@ -2269,7 +4763,7 @@ int table_set_sym(struct table *tbl, char *k, atom v) {
 	}
 }
 
-void table_add(struct table *tbl, atom k, atom v) {
+void table_add(struct arc_table *tbl, atom k, atom v) {
 	if (tbl->size + 1 > tbl->capacity) { /* rehash, load factor = 1 */
 		size_t new_capacity = (tbl->size + 1) * 2;
 		struct table_entry **data2 = malloc(new_capacity * sizeof(struct table_entry *));
@@ -2279,11 +4773,11 @@ void table_add(struct table *tbl, atom k, atom v) {
 		}
 		for (i = 0; i < tbl->capacity; i++) {
 			struct table_entry *p = tbl->data[i];
-			while (p) {
+			while (p) { /* relink in place: a cache_table refers to its entries */
 				struct table_entry **p2 = &data2[hash_code(p->k) % new_capacity];
 				struct table_entry *next = p->next;
-				*p2 = table_entry_new(p->k, p->v, *p2);
-				free(p);
+				p->next = *p2;
+				*p2 = p;
 				p = next;
 			}
 		}
@@ -2293,17 +4787,35 @@ void table_add(struct table *tbl, atom k, atom v) {
 	}
 	/* insert new item */
 	struct table_entry **p = &tbl->data[hash_code(k) % tbl->capacity];
+	if (tbl->kind == TABLE_CACHE) {
+		struct cache_table *c = (struct cache_table *)tbl;
+		struct lru_entry *e = malloc(sizeof(*e));
+		e->e.k = k;
+		e->e.v = v;
+		e->e.next = *p;
+		*p = &e->e;
+		lru_push(c, e);
+		if (++tbl->size > c->limit) lru_evict(c);
+		return;
+	}
 	*p = table_entry_new(k, v, *p);
 	tbl->size++;
 }
 
 /* return entry. return NULL if not found */
-struct table_entry *table_get(struct table *tbl, atom k) {
+struct table_entry *table_get(struct arc_table *tbl, atom k) {
 	if (tbl->size == 0) return NULL;
 	size_t pos = hash_code(k) % tbl->capacity;
 	struct table_entry *p = tbl->data[pos];
+	VM_STAT(table_gets);
 	while (p) {
+		VM_STAT(table_probes);
 		if (iso(p->k, k)) {
+			if (tbl->kind == TABLE_CACHE) { /* p is now the most recently used */
+				struct cache_table *c = (struct cache_table *)tbl;
+				lru_unlink(c, (struct lru_entry *)p);
+				lru_push(c, (struct lru_entry *)p);
+			}
 			return p;
 		}
 		p = p->next;
@@ -2312,11 +4824,13 @@ struct table_entry *table_get(struct table *tbl, atom k) {
 }
 
 /* return entry. return NULL if not found */
-struct table_entry *table_get_sym(struct table *tbl, char *k) {
+struct table_entry *table_get_sym(struct arc_table *tbl, char *k) {
 	if (tbl->size == 0) return NULL;
 	size_t pos = hash_code_sym(k) % tbl->capacity;
 	struct table_entry *p = tbl->data[pos];
+	VM_STAT(table_gets);
 	while (p) {
+		VM_STAT(table_probes);
 		if (p->k.value.symbol == k) {
 			return p;
 		}
@@ -2325,445 +4839,1438 @@ struct table_entry *table_get_sym(struct table *tbl, char *k) {
 	return NULL;
 }
 
-char *slurp_fp(FILE *fp) {
-	char *buf;
-	long len;
+char *slurp_fp(FILE *fp) {
+	char *buf;
+	long len;
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	if (len < 0) return NULL;
+	fseek(fp, 0, SEEK_SET);
+
+	buf = (char *)malloc(len + 1);
+	if (!buf)
+		return NULL;
+
+	if (fread(buf, 1, len, fp) != len) return NULL;
+	buf[len] = 0;
+
+	return buf;
+}
+
+char *slurp(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		/* printf("Reading %s failed.\n", path); */
+		return NULL;
+	}
+	char *r = slurp_fp(fp);
+	fclose(fp);
+	return r;
+}
+
+/* compile-time macro
+ * Subforms still to be expanded are kept on an explicit stack of slots, so
+ * only the macro bodies themselves re-enter the evaluator. */
+error macex(atom expr, atom *result) {
+	error err = ERROR_OK;
+	int ss = ctx->stack_size; /* save stack point */
+	size_t size = 0, capacity = 16;
+	atom **slots = malloc(capacity * sizeof(atom *));
+
+	*result = expr;
+	slots[size++] = result;
+	while (size > 0) {
+		atom *slot = slots[--size];
+		for (;;) {
+			expr = *slot;
+			ctx->cur_expr = expr; /* for error reporting */
+
+			if (expr.type != T_CONS || !listp(expr))
+				break;
+
+			atom op = car(expr), macro;
+
+			/* Handle quote */
+			if (op.type == T_SYM && op.value.symbol == ctx->sym_quote.value.symbol)
+				break;
+
+			/* Is it a macro? */
+			if (op.type == T_SYM && !env_get(ctx->env, op.value.symbol, &macro) && macro.type == T_MACRO) {
+				macro.type = T_CLOSURE;
+				err = eval_apply(macro, NULL, 0, cdr(expr), slot);
+				if (err) goto done;
+				src_loc_copy(expr, *slot);
+				continue; /* expand the expansion */
+			}
+
+			/* macex elements of a copy, leftmost first */
+			atom expr2 = copy_list(expr), h;
+			size_t first = size, last;
+			src_loc_copy(expr, expr2);
+			*slot = expr2;
+			for (h = expr2; !no(h); h = cdr(h)) {
+				if (size == capacity) {
+					capacity *= 2;
+					slots = realloc(slots, capacity * sizeof(atom *));
+				}
+				slots[size++] = &car(h);
+			}
+			for (last = size; first + 1 < last; first++) {
+				atom *t = slots[first];
+				slots[first] = slots[--last];
+				slots[last] = t;
+			}
+			break;
+		}
+	}
+done:
+	free(slots);
+	if (err) {
+		stack_restore(ss);
+		return err;
+	}
+	stack_restore_add(ss, *result);
+	return ERROR_OK;
+}
+
+error macex_eval(atom expr, atom *result) {
+	atom expr2;
+	error err = macex(expr, &expr2);
+	if (err) return err;
+	/*	printf("macex_eval: ");
+		print_expr(expr);
+		puts("");
+		printf("expanded: ");
+		print_expr(expr2);
+		puts("\n");
+	*/
+	return eval_expr(expr2, ctx->env, result);
+}
+
+/* Evaluates the expressions in text; result is the value of the last one */
+error load_string(const char *text, atom *result) {
+	error err = ERROR_OK;
+	const char *p = text;
+	atom expr;
+	*result = nil;
+	while (*p) {
+		if (isspace((int)*p)) {
+			p++;
+			continue;
+		}
+		/* comment */
+		if (*p == ';') {
+			p += strcspn(p, "\n");
+			continue;
+		}
+		ctx->cur_expr = nil;
+		err = read_expr(p, &p, &expr);
+		if (err) {
+			if (err == ERROR_FILE) err = ERROR_SYNTAX; /* the text ends in an open form */
+			break;
+		}
+		err = macex_eval(expr, result);
+		if (err) {
+			break;
+		}
+		/*else {
+			print_expr(result);
+			putchar(' ');
+		}*/
+	}
+	/*puts("");*/
+	return err;
+}
+
+/* Returns the index of path in src_files, adding it if new */
+static long src_file_index(const char *path) {
+	size_t i;
+	for (i = 0; i < ctx->src_file_count; i++) {
+		if (strcmp(ctx->src_files[i], path) == 0) return (long)i;
+	}
+	if (ctx->src_file_count == ctx->src_file_capacity) {
+		ctx->src_file_capacity = ctx->src_file_capacity ? ctx->src_file_capacity * 2 : 8;
+		ctx->src_files = realloc(ctx->src_files, ctx->src_file_capacity * sizeof(char *));
+	}
+	ctx->src_files[ctx->src_file_count] = strdup(path);
+	return (long)ctx->src_file_count++;
+}
+
+error load_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	struct string text;
+	error err;
+	atom expr, result;
+	long line = 1, start, file = ctx->locations ? src_file_index(path) : -1;
+	if (!fp) return ERROR_FILE;
+	/* read and evaluate one expression at a time */
+	string_new(&text);
+	for (;;) {
+		const char *p;
+		ctx->cur_expr = nil;
+		if ((err = read_text_fp_lines(fp, &text, &line, &start))) break;
+		p = text.str;
+		ctx->src_file = file; /* record where the lists read start */
+		ctx->src_pos = p;
+		ctx->src_line = start;
+		err = read_expr(p, &p, &expr);
+		ctx->src_file = -1;
+		if (!err) err = macex_eval(expr, &result);
+		if (err) break;
+	}
+	if (err == ERROR_FILE) err = ERROR_OK; /* the end */
+	free(text.str);
+	fclose(fp);
+	return err;
+}
+
+error frame_push(enum frame_kind kind, atom expr, atom env, atom args) {
+	if (ctx->es.frame_size >= ctx->eval_depth_limit)
+		return ERROR_STACK;
+	if (ctx->es.frame_size == ctx->es.frame_capacity) {
+		ctx->es.frame_capacity = ctx->es.frame_capacity ? ctx->es.frame_capacity * 2 : 64;
+		ctx->es.frames = realloc(ctx->es.frames, ctx->es.frame_capacity * sizeof(struct frame));
+	}
+	struct frame *f = &ctx->es.frames[ctx->es.frame_size++];
+	f->kind = kind;
+	f->expr = expr;
+	f->env = env;
+	f->args = args;
+	f->vbase = ctx->es.value_size;
+#ifdef ARC_STATS
+	f->body = ctx->vm_body;
+#endif
+	return ERROR_OK;
+}
+
+void value_push(atom a) {
+	if (ctx->es.value_size == ctx->es.value_capacity) {
+		ctx->es.value_capacity = ctx->es.value_capacity ? ctx->es.value_capacity * 2 : 64;
+		ctx->es.values = realloc(ctx->es.values, ctx->es.value_capacity * sizeof(atom));
+	}
+	ctx->es.values[ctx->es.value_size++] = a;
+}
+
+atom make_continuation(size_t fbase, size_t vbase) {
+	atom a;
+	struct arc_continuation *k;
+	ctx->alloc_count++;
+	k = a.value.cont = malloc(sizeof(struct arc_continuation));
+	k->live = 1;
+	k->captured = 1;
+	k->depth = ctx->es.frame_size;
+	k->fbase = fbase;
+	k->vbase = vbase;
+	k->frames = NULL;
+	k->frame_size = 0;
+	k->values = NULL;
+	k->value_size = 0;
+	k->thread = ctx->cur_thread;
+	k->mark = 0;
+	k->next = ctx->cont_head;
+	ctx->cont_head = k;
+	a.type = T_CONTINUATION;
+	stack_add(a);
+	return a;
+}
+
+/* Copies the frames and values below k's F_CCC frame, which is about to be
+ * popped, so that k can be reinstated later. */
+void cont_seal(struct arc_continuation *k) {
+	size_t i;
+	k->live = 0;
+	if (k->frames) return; /* reinstated copy of an already sealed frame */
+	if (!k->captured) return;
+	k->frame_size = k->depth - k->fbase;
+	k->frames = malloc((k->frame_size + 1) * sizeof(struct frame));
+	memcpy(k->frames, ctx->es.frames + k->fbase, k->frame_size * sizeof(struct frame));
+	k->value_size = ctx->es.frames[k->depth].vbase - k->vbase;
+	k->values = malloc((k->value_size + 1) * sizeof(atom));
+	memcpy(k->values, ctx->es.values + k->vbase, k->value_size * sizeof(atom));
+	/* the continuations of the F_CCC frames in the copy can be invoked again
+	 * once it is reinstated */
+	for (i = 0; i < k->frame_size; i++) {
+		if (k->frames[i].kind == F_CCC) k->frames[i].args.value.cont->captured = 1;
+	}
+}
+
+/* Returns whether the continuation k passed to receiver may be reachable
+ * after receiver returns. It is not if receiver is (fn (k) ...) and its body
+ * uses k only as the operator of calls, outside any nested fn or mac. Other
+ * continuations that copy the F_CCC frame set captured in cont_seal. */
+static int cont_captured(atom receiver) {
+	atom params, k;
+	struct arc_vector forms;
+	int captured = 0;
+	if (receiver.type != T_CLOSURE) return 1;
+	params = car(cdr(receiver));
+	if (params.type != T_CONS || car(params).type != T_SYM || !no(cdr(params))) return 1;
+	k = car(params);
+	if (is(cdr(cdr(receiver)), k)) return 1; /* (fn (k) k) */
+	vector_new(&forms);
+	vector_add(&forms, cdr(cdr(receiver)));
+	while (forms.size && !captured) {
+		atom x = forms.data[--forms.size], op, p;
+		size_t base = forms.size;
+		if (x.type != T_CONS) continue;
+		op = car(x);
+		if (is(op, ctx->sym_quote)) continue;
+		if (is(op, ctx->sym_fn) || is(op, ctx->sym_mac) || is(op, ctx->sym_quasiquote)) {
+			/* any k in it, even in a call, may outlive the frame */
+			vector_add(&forms, x);
+			while (forms.size > base && !captured) {
+				p = forms.data[--forms.size];
+				if (p.type == T_CONS) {
+					vector_add(&forms, car(p));
+					vector_add(&forms, cdr(p));
+				}
+				else if (is(p, k)) captured = 1;
+			}
+			continue;
+		}
+		if (!is(op, k)) vector_add(&forms, op);
+		for (p = cdr(x); p.type == T_CONS; p = cdr(p)) {
+			if (is(car(p), k)) captured = 1;
+			else vector_add(&forms, car(p));
+		}
+		if (is(p, k)) captured = 1; /* (f . k) */
+	}
+	vector_free(&forms);
+	return captured;
+}
+
+/* Names closure fn after the variable it is first assigned to */
+static void closure_name(atom fn, atom name) {
+	if (!ptr_map_get(&ctx->closure_names, fn.value.pair))
+		ptr_map_put(&ctx->closure_names, fn.value.pair, name);
+}
+
+/* Returns the name symbol of closure fn: the variable it was assigned to,
+ * or else where it was defined, as fn@file:line; nil if neither is known */
+static atom closure_label(atom fn) {
+	atom *name = ptr_map_get(&ctx->closure_names, fn.value.pair);
+	char buf[512] = "fn@";
+	double loc;
+	if (name) return *name;
+	if (!(loc = src_loc(fn))) return nil;
+	src_loc_format(loc, buf + 3, sizeof(buf) - 3);
+	return make_sym(buf);
+}
+
+/* Returns the index of the profile entry of closure fn. Closures are
+ * counted by label; all the anonymous ones share an entry. */
+static long prof_entry_of(atom fn) {
+	atom name = closure_label(fn), *i;
+	void *key = no(name) ? (void *)&ctx->prof : (void *)name.value.symbol; /* anonymous */
+	struct prof_entry *e;
+	if ((i = ptr_map_get(&ctx->prof_index, key))) return (long)i->value.number;
+	if (ctx->prof_count == ctx->prof_capacity) {
+		ctx->prof_capacity = ctx->prof_capacity ? ctx->prof_capacity * 2 : 64;
+		ctx->prof = realloc(ctx->prof, ctx->prof_capacity * sizeof(struct prof_entry));
+	}
+	e = &ctx->prof[ctx->prof_count];
+	e->name = name;
+	e->calls = 0;
+	e->total = e->self = 0;
+	e->active = 0;
+	ptr_map_put(&ctx->prof_index, key, make_number((double)ctx->prof_count));
+	return (long)ctx->prof_count++;
+}
+
+/* Charges the time since the last call or return to the running closure */
+static double prof_tick() {
+	double now = now_seconds();
+	if (ctx->prof_cur >= 0 && (size_t)ctx->prof_cur < ctx->prof_count)
+		ctx->prof[ctx->prof_cur].self += now - ctx->prof_last;
+	ctx->prof_last = now;
+	return now;
+}
+
+/* Enters closure fn, pushing the F_CALL frame that prof_leave pops */
+static error prof_enter(atom fn) {
+	double now;
+	long i;
+	error err;
+	if (!ctx->profiling) return frame_push(F_CALL, fn, nil, nil); /* only sampling */
+	now = prof_tick();
+	i = prof_entry_of(fn);
+	err = frame_push(F_CALL, fn, make_number(ctx->prof_cur), make_number(now));
+	if (err) return err;
+	ctx->prof[i].calls++;
+	ctx->prof[i].active++;
+	ctx->prof_cur = i;
+	return ERROR_OK;
+}
+
+static void prof_leave(struct frame *f) {
+	double now;
+	if (f->env.type != T_NUM) return; /* pushed for sampling */
+	now = prof_tick();
+	if (ctx->prof_cur >= 0 && (size_t)ctx->prof_cur < ctx->prof_count) {
+		struct prof_entry *e = &ctx->prof[ctx->prof_cur];
+		if (e->active > 0 && --e->active == 0) e->total += now - f->args.value.number;
+	}
+	ctx->prof_cur = (long)f->env.value.number;
+}
+
+/* Starts profiling closure calls afresh */
+void profile_start(void) {
+	ctx->profiling = 1;
+	ctx->prof_count = 0;
+	ptr_map_free(&ctx->prof_index);
+	ptr_map_new(&ctx->prof_index);
+	ctx->prof_cur = -1;
+	ctx->prof_last = now_seconds();
+}
+
+static int prof_compare(const void *a, const void *b) {
+	double x = ((const struct prof_entry *)a)->self, y = ((const struct prof_entry *)b)->self;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	if (len < 0) return NULL;
-	fseek(fp, 0, SEEK_SET);
+/* Prints the profile so far, by self time */
+void profile_report(FILE *fp) {
+	struct prof_entry *sorted;
+	size_t i;
+	if (!ctx->profiling) return;
+	prof_tick();
+	sorted = malloc((ctx->prof_count + 1) * sizeof(struct prof_entry));
+	memcpy(sorted, ctx->prof, ctx->prof_count * sizeof(struct prof_entry));
+	qsort(sorted, ctx->prof_count, sizeof(struct prof_entry), prof_compare);
+	fprintf(fp, "%12s %12s %12s  %s\n", "calls", "total (s)", "self (s)", "function");
+	for (i = 0; i < ctx->prof_count; i++) {
+		struct prof_entry *e = &sorted[i];
+		fprintf(fp, "%12lu %12.6f %12.6f  %s\n", e->calls, e->total, e->self,
+			no(e->name) ? "(anonymous)" : e->name.value.symbol);
+	}
+	free(sorted);
+}
 
-	buf = (char *)malloc(len + 1);
-	if (!buf)
-		return NULL;
+/* The profiling timer and SIGPROF belong to the process, so one context at
+ * a time may sample */
+#ifndef _WIN32
+static volatile sig_atomic_t sample_due; /* set by SIGPROF */
+static struct arc_context *sampler; /* the context sampling, or NULL */
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	if (fread(buf, 1, len, fp) != len) return NULL;
-	buf[len] = 0;
+static void sample_signal(int sig) {
+	(void)sig;
+	sample_due = 1;
+}
+#endif
 
-	return buf;
+static void samples_clear(void) {
+	size_t i;
+	for (i = 0; i < ctx->sample_capacity; i++) free(ctx->samples[i].stack);
+	memset(ctx->samples, 0, ctx->sample_capacity * sizeof(struct sample_entry));
+	ctx->sample_count = 0;
 }
 
-char *slurp(const char *path)
-{
-	FILE *fp = fopen(path, "rb");
-	if (!fp) {
-		/* printf("Reading %s failed.\n", path); */
-		return NULL;
+/* Counts one sample of the stack of closures being called, outermost first */
+static void sample_take(void) {
+	struct string s;
+	size_t i, mask;
+	struct sample_entry *e;
+#ifndef _WIN32
+	sample_due = 0;
+#endif
+	string_new(&s);
+	for (i = 0; i < ctx->es.frame_size; i++) {
+		struct frame *f = &ctx->es.frames[i];
+		atom name;
+		if (f->kind != F_CALL) continue;
+		if (s.len) string_putc(&s, ';');
+		name = closure_label(f->expr);
+		string_cat(&s, no(name) ? "(anonymous)" : name.value.symbol);
+	}
+	if (!s.len) string_cat(&s, "(toplevel)");
+	if (2 * (ctx->sample_count + 1) > ctx->sample_capacity) { /* grow */
+		struct sample_entry *old = ctx->samples;
+		size_t j, old_capacity = ctx->sample_capacity;
+		ctx->sample_capacity *= 2;
+		ctx->samples = calloc(ctx->sample_capacity, sizeof(struct sample_entry));
+		mask = ctx->sample_capacity - 1;
+		for (j = 0; j < old_capacity; j++) {
+			if (!old[j].stack) continue;
+			for (i = symbol_hash(old[j].stack, strlen(old[j].stack)) & mask; ctx->samples[i].stack; i = (i + 1) & mask);
+			ctx->samples[i] = old[j];
+		}
+		free(old);
+	}
+	mask = ctx->sample_capacity - 1;
+	for (i = symbol_hash(s.str, s.len) & mask; (e = &ctx->samples[i])->stack; i = (i + 1) & mask) {
+		if (strcmp(e->stack, s.str) == 0) {
+			e->count++;
+			free(s.str);
+			return;
+		}
 	}
-	char *r = slurp_fp(fp);
-	fclose(fp);
-	return r;
+	e->stack = s.str;
+	e->count = 1;
+	ctx->sample_count++;
 }
 
-/* compile-time macro */
-error macex(atom expr, atom *result) {
-	error err = ERROR_OK;
-
-	cur_expr = expr; /* for error reporting */
+/* Starts sampling the call stack every interval seconds of CPU time, from
+ * no samples. Returns nonzero, and does nothing, if another context of the
+ * process is sampling. Sampling needs SIGPROF, so on Windows no samples are
+ * taken. */
+int sample_start(double interval) {
+#ifndef _WIN32
+	struct sigaction sa;
+	struct itimerval it;
+	pthread_mutex_lock(&sampler_lock);
+	if (sampler && sampler != ctx) {
+		pthread_mutex_unlock(&sampler_lock);
+		return -1;
+	}
+	sampler = ctx;
+	pthread_mutex_unlock(&sampler_lock);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sample_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+	it.it_interval.tv_sec = (time_t)interval;
+	it.it_interval.tv_usec = (suseconds_t)((interval - (time_t)interval) * 1e6);
+	if (!it.it_interval.tv_sec && !it.it_interval.tv_usec) it.it_interval.tv_usec = 1;
+	it.it_value = it.it_interval;
+	setitimer(ITIMER_PROF, &it, NULL);
+#endif
+	ctx->sampling = 1;
+	samples_clear();
+	return 0;
+}
 
-	if (expr.type != T_CONS || !listp(expr)) {
-		*result = expr;
-		return ERROR_OK;
+void sample_stop(void) {
+#ifndef _WIN32
+	struct itimerval it;
+	pthread_mutex_lock(&sampler_lock);
+	if (sampler == ctx) {
+		memset(&it, 0, sizeof(it));
+		setitimer(ITIMER_PROF, &it, NULL);
+		sampler = NULL;
 	}
-	else {
-		int ss = stack_size; /* save stack point */
-		atom op = car(expr);
+	pthread_mutex_unlock(&sampler_lock);
+#endif
+	ctx->sampling = 0;
+}
 
-		/* Handle quote */
-		if (op.type == T_SYM && op.value.symbol == sym_quote.value.symbol) {
-			*result = expr;
-			return ERROR_OK;
-		}
+/* Writes the samples so far in the folded format of flamegraph.pl: one line
+ * per stack, its closures separated by ';', then the number of samples. */
+void sample_report(FILE *fp) {
+	size_t i;
+	for (i = 0; i < ctx->sample_capacity; i++) {
+		if (ctx->samples[i].stack)
+			fprintf(fp, "%s %lu\n", ctx->samples[i].stack, ctx->samples[i].count);
+	}
+}
 
-		atom args = cdr(expr);
+/* Starts recording one in every allocations of pairs, strings and tables,
+ * from none. 0 stops recording and keeps what was recorded. */
+void alloc_profile_start(unsigned long every) {
+	ctx->alloc_sample = every;
+	ctx->alloc_countdown = every;
+	if (!every) return;
+	ctx->alloc_site_count = 0;
+	ptr_map_free(&ctx->alloc_index);
+	ptr_map_new(&ctx->alloc_index);
+}
 
-		/* Is it a macro? */
-		if (op.type == T_SYM && !env_get(env, op.value.symbol, result) && result->type == T_MACRO) {
-			/* Evaluate operator */
-			op = *result;
-
-			op.type = T_CLOSURE;
-
-			atom result2;
-			struct vector vargs;
-			atom_to_vector(args, &vargs);
-			err = apply(op, &vargs, &result2);
-			if (err) {
-				vector_free(&vargs);
-				stack_restore(ss);
-				return err;
-			}
-			err = macex(result2, result); /* recursive */
-			if (err) {
-				vector_free(&vargs);
-				stack_restore(ss);
-				return err;
-			}
-			vector_free(&vargs);
-			stack_restore_add(ss, *result);
-			return ERROR_OK;
-		}
-		else {
-			/* macex elements */
-			atom expr2 = copy_list(expr);
-			atom h;
-			for (h = expr2; !no(h); h = cdr(h)) {
-				err = macex(car(h), &car(h));
-				if (err) {
-					stack_restore(ss);
-					return err;
-				}
-			}
-			*result = expr2;
-			stack_restore_add(ss, *result);
-			return ERROR_OK;
-		}
-	}
+static int alloc_site_compare(const void *a, const void *b) {
+	double x = ((const struct alloc_site *)a)->bytes, y = ((const struct alloc_site *)b)->bytes;
+	return x < y ? 1 : x > y ? -1 : 0;
 }
 
-error macex_eval(atom expr, atom *result) {
-	atom expr2;
-	error err = macex(expr, &expr2);
-	if (err) return err;
-	/*	printf("macex_eval: ");
-		print_expr(expr);
-		puts("");
-		printf("expanded: ");
-		print_expr(expr2);
-		puts("\n");
-	*/
-	return eval_expr(expr2, env, result);
+/* Prints the forms that allocated, most bytes first */
+void alloc_profile_report(FILE *fp) {
+	struct alloc_site *sorted;
+	size_t i;
+	sorted = malloc((ctx->alloc_site_count + 1) * sizeof(struct alloc_site));
+	memcpy(sorted, ctx->alloc_sites, ctx->alloc_site_count * sizeof(struct alloc_site));
+	qsort(sorted, ctx->alloc_site_count, sizeof(struct alloc_site), alloc_site_compare);
+	fprintf(fp, "%12s %12s  %s\n", "objects", "bytes", "form");
+	for (i = 0; i < ctx->alloc_site_count; i++) {
+		struct alloc_site *site = &sorted[i];
+		char *form = no(site->form) ? strdup("(outside any form)") : to_string(site->form, 1);
+		if (strlen(form) > 64) strcpy(form + 60, " ...");
+		fprintf(fp, "%12.0f %12.0f  %s\n", site->objects, site->bytes, form);
+		free(form);
+	}
+	free(sorted);
 }
 
-error load_string(const char *text) {
-	error err = ERROR_OK;
-	const char *p = text;
-	atom expr;
-	while (*p) {
-		if (isspace((int)*p)) {
-			p++;
-			continue;
-		}
-		/* comment */
-		if (*p == ';') {
-			p += strcspn(p, "\n");
-			continue;
-		}
-		err = read_expr(p, &p, &expr);
-		if (err) {
+#define BACKTRACE_MAX 20 /* calls shown */
+
+/* Records where the error being raised happened, and the calls in progress
+ * innermost first, for print_error */
+static void backtrace_record(void) {
+	struct string *bt = &ctx->backtrace;
+	size_t i = ctx->es.frame_size, n = 0;
+	char buf[512];
+	double loc;
+	if ((loc = src_loc(ctx->cur_expr))) {
+		src_loc_format(loc, buf, sizeof(buf));
+		string_cat(bt, "  at ");
+		string_cat(bt, buf);
+		string_cat(bt, "\n");
+	}
+	while (i-- > 0) {
+		struct frame *f = &ctx->es.frames[i];
+		char *form;
+		if (f->kind != F_ARGS) continue;
+		if (n++ == BACKTRACE_MAX) {
+			string_cat(bt, "  ...\n");
 			break;
 		}
-		atom result;
-		err = macex_eval(expr, &result);
-		if (err) {
-			break;
+		form = to_string(f->expr, 1);
+		if (strlen(form) > 64) strcpy(form + 60, " ...");
+		string_cat(bt, "  in ");
+		string_cat(bt, form);
+		free(form);
+		if ((loc = src_loc(f->expr))) {
+			src_loc_format(loc, buf, sizeof(buf));
+			string_cat(bt, " at ");
+			string_cat(bt, buf);
 		}
-		/*else {
-			print_expr(result);
-			putchar(' ');
-		}*/
+		string_cat(bt, "\n");
 	}
-	/*puts("");*/
-	return err;
 }
 
-error arc_load_file(const char *path)
-{
-	char *text;
-	error err = ERROR_OK;
-	/* printf("Reading %s...\n", path); */
-	text = slurp(path);
-	if (text) {
-		err = load_string(text);
-		free(text);
-		return err;
+/* Pops frames down to index to. Continuations whose frames are popped by an
+ * escape stay re-enterable; an error just ends them. */
+void frames_unwind(size_t to, int seal) {
+	while (ctx->es.frame_size > to) {
+		struct frame *f = &ctx->es.frames[ctx->es.frame_size - 1];
+		if (f->kind == F_CCC) {
+			if (seal)
+				cont_seal(f->args.value.cont);
+			else
+				f->args.value.cont->live = 0;
+		}
+		else if (f->kind == F_CALL)
+			prof_leave(f);
+		ctx->es.frame_size--;
+	}
+}
+
+/* Returns the index of the frame that invoking continuation k returns from,
+ * or (size_t)-1 if that frame is no longer on the stack. */
+size_t cont_frame(atom k) {
+	if (k.type == T_CONTINUATION) {
+		struct arc_continuation *c = k.value.cont;
+		return c->live && c->thread == ctx->cur_thread ? c->depth : (size_t)-1;
 	}
 	else {
-		return ERROR_FILE;
+		size_t i = ctx->es.frame_size;
+		while (i-- > 0) {
+			struct frame *f = &ctx->es.frames[i];
+			if (f->kind == F_ESCAPE && f->args.value.serial == k.value.serial)
+				return i;
+		}
+		return (size_t)-1;
 	}
 }
 
-error eval_expr(atom expr, atom env, atom *result)
+/* The evaluator does not recurse in C. Work that remains after a subexpression
+ * is pushed as a frame on es, and its result is delivered to the top frame at
+ * ret. A nested call, e.g. a builtin calling apply, starts a run above the
+ * frames of its caller and returns once the stack is back to where it started.
+ * If call is set, the run starts by applying es.values[vbase] to the values
+ * above it followed by the list tail instead of evaluating expr.
+ * Only the outermost run switches threads, since a nested run has C callers
+ * that cannot be suspended. It returns once the main thread is done. */
+static error eval_run(int call, atom expr, atom env, size_t vbase, atom tail, atom *result)
 {
-	error err;
-	int ss = stack_size; /* save stack point */
-start_eval:
-	consider_gc();
-	cur_expr = expr; /* for error reporting */
+	error err = ERROR_OK;
+	const size_t fbase = ctx->es.frame_size;
+	int ss = ctx->stack_size; /* save stack point */
+	const int sched = ++ctx->run_depth == 1;
+	struct frame *f;
+	struct arc_thread *t;
+	atom val, fn;
+	size_t argv = 0; /* value stack index of the first argument of a call */
+
+	ctx->yield_ok = 0;
+	if (sched) ctx->backtrace.len = 0; /* of an error no one printed */
+
+	if (call) {
+		argv = vbase + 1;
+		fn = ctx->es.values[vbase];
+		goto call;
+	}
+
+eval:
+	/* everything still needed is reachable from es, expr or env */
+	ctx->stack_size = ss;
+#ifndef _WIN32
+	if (sample_due && ctx->sampling) sample_take();
+#endif
+	if (ctx->alloc_count > 2 * ctx->alloc_count_old) {
+		stack_add(expr);
+		stack_add(env);
+		gc();
+		ctx->stack_size = ss;
+	}
+	if (sched && ctx->thread_count > 1 && --ctx->sched_ticks <= 0) { /* preempt */
+		ctx->cur_thread->state = TS_EVAL;
+		ctx->cur_thread->expr = expr;
+		ctx->cur_thread->env = env;
+		goto sched;
+	}
+	ctx->cur_expr = expr; /* for error reporting */
+	VM_STAT(evals);
 	if (expr.type == T_SYM) {
-		err = env_get(env, expr.value.symbol, result);
-		return err;
+		VM_STAT(evals_symbol);
+		err = env_get(env, expr.value.symbol, &val);
+		if (err) goto fail;
+		goto ret;
 	}
 	else if (expr.type != T_CONS) {
-		*result = expr;
-		return ERROR_OK;
+		VM_STAT(evals_self);
+		val = expr;
+		goto ret;
 	}
 	else {
 		atom op = car(expr);
 		atom args = cdr(expr);
 
+		VM_STAT(evals_form);
 		if (op.type == T_SYM) {
 			/* Handle special forms */
-			if (op.value.symbol == sym_if.value.symbol) {
-				atom *p = &args;
-				while (!no(*p)) {
-					atom cond;
-					if (no(cdr(*p))) { /* else */
-						/* tail call optimization of else part */
-						expr = car(*p);
-						goto start_eval;
-					}
-					err = eval_expr(car(*p), env, &cond);
-					if (err) {
-						stack_restore(ss);
-						return err;
-					}
-					if (!no(cond)) { /* then */
-						/* tail call optimization of err = eval_expr(car(cdr(*p)), env, result); */
-						expr = car(cdr(*p));
-						goto start_eval;
-					}
-					p = &cdr(cdr(*p));
+			if (op.value.symbol == ctx->sym_if.value.symbol) {
+				VM_STAT(sf_if);
+				if (no(args)) {
+					val = nil;
+					goto ret;
 				}
-				*result = nil;
-				stack_restore_add(ss, *result);
-				return ERROR_OK;
+				if (!no(cdr(args))) {
+					err = frame_push(F_IF, expr, env, args);
+					if (err) goto fail;
+				}
+				/* else part alone is in tail position */
+				expr = car(args);
+				goto eval;
 			}
-			else if (op.value.symbol == sym_assign.value.symbol) {
-				atom sym;
+			else if (op.value.symbol == ctx->sym_assign.value.symbol) {
+				VM_STAT(sf_assign);
 				if (no(args) || no(cdr(args))) {
-					stack_restore(ss);
-					return ERROR_ARGS;
-				}
-
-				sym = car(args);
-				if (sym.type == T_SYM) {
-					atom val;
-					err = eval_expr(car(cdr(args)), env, &val);
-					if (err) {
-						stack_restore(ss);
-						return err;
-					}
-
-					*result = val;
-					err = env_assign_eq(env, sym.value.symbol, val);
-					stack_restore_add(ss, *result);
-					return err;
+					err = ERROR_ARGS;
+					goto fail;
 				}
-				else {
-					stack_restore(ss);
-					return ERROR_TYPE;
+				if (car(args).type != T_SYM) {
+					err = ERROR_TYPE;
+					goto fail;
 				}
+				err = frame_push(F_ASSIGN, car(args), env, nil);
+				if (err) goto fail;
+				expr = car(cdr(args));
+				goto eval;
 			}
-			else if (op.value.symbol == sym_quote.value.symbol) {
+			else if (op.value.symbol == ctx->sym_quote.value.symbol) {
+				VM_STAT(sf_quote);
 				if (no(args) || !no(cdr(args))) {
-					stack_restore(ss);
-					return ERROR_ARGS;
+					err = ERROR_ARGS;
+					goto fail;
 				}
-
-				*result = car(args);
-				stack_restore_add(ss, *result);
-				return ERROR_OK;
+				val = car(args);
+				goto ret;
 			}
-			else if (op.value.symbol == sym_fn.value.symbol) {
+			else if (op.value.symbol == ctx->sym_fn.value.symbol) {
+				VM_STAT(sf_fn);
 				if (no(args)) {
-					stack_restore(ss);
-					return ERROR_ARGS;
+					err = ERROR_ARGS;
+					goto fail;
 				}
-				err = make_closure(env, car(args), cdr(args), result);
-				stack_restore_add(ss, *result);
-				return err;
-			}
-			else if (op.value.symbol == sym_do.value.symbol) {
-				/* Evaluate the body */
-				while (!no(args)) {
-					if (no(cdr(args))) {
-						/* tail call */
-						expr = car(args);
-						stack_restore(ss);
-						goto start_eval;
-					}
-					error err = eval_expr(car(args), env, result);
-					if (err) {
-						return err;
-					}
-					args = cdr(args);
+				err = make_closure(env, car(args), cdr(args), &val);
+				if (err) goto fail;
+				src_loc_closure(expr, val);
+				goto ret;
+			}
+			else if (op.value.symbol == ctx->sym_do.value.symbol) {
+				VM_STAT(sf_do);
+				if (no(args)) {
+					val = nil;
+					goto ret;
 				}
-				return ERROR_OK;
+				if (!no(cdr(args))) {
+					err = frame_push(F_DO, expr, env, cdr(args));
+					if (err) goto fail;
+				}
+				expr = car(args);
+				goto eval;
 			}
-			else if (op.value.symbol == sym_mac.value.symbol) { /* (mac name (arg ...) body) */
+			else if (op.value.symbol == ctx->sym_mac.value.symbol) { /* (mac name (arg ...) body) */
 				atom name, macro;
 
+				VM_STAT(sf_mac);
 				if (no(args) || no(cdr(args)) || no(cdr(cdr(args)))) {
-					stack_restore(ss);
-					return ERROR_ARGS;
+					err = ERROR_ARGS;
+					goto fail;
 				}
 
 				name = car(args);
 				if (name.type != T_SYM) {
-					stack_restore(ss);
-					return ERROR_TYPE;
+					err = ERROR_TYPE;
+					goto fail;
 				}
 
 				err = make_closure(env, car(cdr(args)), cdr(cdr(args)), &macro);
-				if (!err) {
-					macro.type = T_MACRO;
-					*result = name;
-					err = env_assign(env, name.value.symbol, macro);
-					stack_restore_add(ss, *result);
-					return err;
-				}
-				else {
-					stack_restore(ss);
-					return err;
-				}
+				if (err) goto fail;
+				macro.type = T_MACRO;
+				env_assign(env, name.value.symbol, macro);
+				val = name;
+				goto ret;
 			}
 		}
 
-		/* Evaluate operator */
-		atom fn;
-		err = eval_expr(op, env, &fn);
-		if (err) {
-			stack_restore(ss);
-			return err;
-		}
+		/* Evaluate operator, then arguments */
+		err = frame_push(F_ARGS, expr, env, args);
+		if (err) goto fail;
+		expr = op;
+		goto eval;
+	}
 
-		/* Evaulate arguments */
-		struct vector vargs;
-		vector_new(&vargs);
-		atom *p = &args;
-		while (!no(*p)) {
-			atom r;
-			err = eval_expr(car(*p), env, &r);
-			if (err) {
-				vector_free(&vargs);
-				stack_restore(ss);
-				return err;
+ret:
+	if (sched && ctx->yield_pending) {
+		ctx->cur_thread->state = TS_RET;
+		ctx->cur_thread->val = val;
+		goto sched;
+	}
+	if (ctx->es.frame_size == fbase) {
+		if (sched && ctx->cur_thread != &ctx->main_thread) {
+			ctx->cur_thread->dead = 1;
+			goto sched;
+		}
+		*result = val;
+		stack_restore_add(ss, val);
+		ctx->run_depth--;
+		return ERROR_OK;
+	}
+	f = &ctx->es.frames[ctx->es.frame_size - 1];
+#ifdef ARC_STATS
+	ctx->vm_body = f->body; /* back in the body that pushed f */
+#endif
+	switch (f->kind) {
+	case F_IF:
+		env = f->env;
+		if (!no(val)) { /* then */
+			expr = car(cdr(f->args));
+			ctx->es.frame_size--;
+			goto eval;
+		}
+		f->args = cdr(cdr(f->args));
+		if (no(f->args)) {
+			ctx->es.frame_size--;
+			val = nil;
+			goto ret;
+		}
+		expr = car(f->args);
+		if (no(cdr(f->args))) { /* else */
+			ctx->es.frame_size--;
+		}
+		goto eval;
+	case F_ASSIGN:
+		ctx->es.frame_size--;
+		env_assign_eq(f->env, f->expr.value.symbol, val);
+		if (val.type == T_CLOSURE) closure_name(val, f->expr);
+		goto ret;
+	case F_DO:
+		env = f->env;
+		expr = car(f->args);
+		f->args = cdr(f->args);
+		if (no(f->args)) { /* last form is in tail position */
+			ctx->es.frame_size--;
+		}
+		goto eval;
+	case F_ARGS:
+		value_push(val);
+		if (!no(f->args)) {
+			if (f->args.type != T_CONS) {
+				err = ERROR_SYNTAX;
+				goto fail;
 			}
-			vector_add(&vargs, r);
-			p = &cdr(*p);
+			env = f->env;
+			expr = car(f->args);
+			f->args = cdr(f->args);
+			goto eval;
 		}
-
-		/* tail call optimization of err = apply(fn, args, result); */
-		if (fn.type == T_CLOSURE) {
-			atom arg_names = car(cdr(fn));
-			env = env_create(car(fn));
-			expr = cdr(cdr(fn));
-
-			/* Bind the arguments */
-			err = env_bind(env, arg_names, &vargs);
-			if (err) {
-				return err;
+		ctx->cur_expr = f->expr;
+		argv = f->vbase + 1;
+		fn = ctx->es.values[f->vbase];
+		ctx->es.frame_size--;
+		tail = nil;
+		goto call;
+	case F_CCC:
+		ctx->es.frame_size--;
+		cont_seal(f->args.value.cont);
+		goto ret;
+	case F_ESCAPE:
+		ctx->es.frame_size--;
+		goto ret;
+	case F_CALL:
+		ctx->es.frame_size--;
+		prof_leave(f);
+		goto ret;
+	}
+
+call: /* apply fn to es.values[argv..value_size) followed by the list tail */
+	if (fn.type == T_CLOSURE) {
+		/* tail call: the body replaces the call */
+		env = env_create(car(fn));
+		/* env_bind reads the value stack before it can evaluate a default
+		 * argument, so the pointer stays valid though a nested run may grow it */
+		err = env_bind(env, car(cdr(fn)), ctx->es.values + argv, ctx->es.value_size - argv, tail);
+		if (err) goto fail;
+		ctx->es.value_size = argv - 1;
+		if (ctx->profiling || ctx->sampling) {
+			/* in tail position the call ends the profiled call it replaces */
+			if (ctx->es.frame_size > fbase && ctx->es.frames[ctx->es.frame_size - 1].kind == F_CALL)
+				prof_leave(&ctx->es.frames[--ctx->es.frame_size]);
+			err = prof_enter(fn);
+			if (err) goto fail;
+		}
+#ifdef ARC_STATS
+		/* nothing of the caller's body is pending when the call is its last act */
+		ctx->vm_stats.closure_calls++;
+		if (ctx->es.frame_size == ctx->vm_body) ctx->vm_stats.tail_calls++;
+		ctx->vm_body = ctx->es.frame_size;
+#endif
+		expr = cdr(cdr(fn));
+		goto eval;
+	}
+	if (fn.type == T_BUILTIN && fn.value.builtin == builtin_apply && no(tail)) {
+		/* (apply f arg ... list): call f here instead of recursing through apply */
+		if (ctx->es.value_size - argv < 2) {
+			err = ERROR_ARGS;
+			goto fail;
+		}
+		tail = ctx->es.values[--ctx->es.value_size];
+		if (!listp(tail)) {
+			err = ERROR_TYPE;
+			goto fail;
+		}
+		fn = ctx->es.values[argv];
+		memmove(ctx->es.values + argv - 1, ctx->es.values + argv, (ctx->es.value_size - argv) * sizeof(atom));
+		ctx->es.value_size--;
+		goto call;
+	}
+	for (; !no(tail); tail = cdr(tail)) {
+		value_push(car(tail));
+	}
+	if (fn.type == T_BUILTIN && (fn.value.builtin == builtin_ccc || fn.value.builtin == builtin_call_ec)) {
+		/* (ccc f): call f with a continuation that returns from here */
+		atom receiver = ctx->es.values[argv], k;
+		if (ctx->es.value_size - argv != 1) {
+			err = ERROR_ARGS;
+			goto fail;
+		}
+		if (receiver.type != T_BUILTIN && receiver.type != T_CLOSURE
+			&& receiver.type != T_CONTINUATION && receiver.type != T_ESCAPE) {
+			err = ERROR_TYPE;
+			goto fail;
+		}
+		ctx->es.value_size = argv - 1;
+		if (fn.value.builtin == builtin_ccc) {
+			k = make_continuation(fbase, vbase);
+			k.value.cont->captured = cont_captured(receiver);
+			err = frame_push(F_CCC, ctx->cur_expr, nil, k);
+		}
+		else {
+			k.type = T_ESCAPE;
+			k.value.serial = ++ctx->escape_serial;
+			err = frame_push(F_ESCAPE, ctx->cur_expr, nil, k);
+		}
+		if (err) goto fail;
+		value_push(receiver);
+		value_push(k);
+		argv = ctx->es.value_size - 1;
+		fn = receiver;
+		goto call;
+	}
+	if (fn.type == T_CONTINUATION || fn.type == T_ESCAPE) {
+		size_t d = cont_frame(fn), argc = ctx->es.value_size - argv;
+		if (argc > 1) {
+			err = ERROR_ARGS;
+			goto fail;
+		}
+		val = argc ? ctx->es.values[argv] : nil;
+		ctx->es.value_size = argv - 1;
+		if (d != (size_t)-1) {
+			if (d < fbase) { /* its frame belongs to a run further out */
+				ctx->thrown = val;
+				ctx->throw_target = fn;
+				err = ERROR_THROW;
+				goto fail;
+			}
+			ctx->es.value_size = ctx->es.frames[d].vbase;
+			frames_unwind(d, 1);
+			goto ret;
+		}
+		if (fn.type == T_CONTINUATION && fn.value.cont->frames) {
+			/* reinstate the copied frames in place of the rest of this run */
+			struct arc_continuation *k = fn.value.cont;
+			size_t i, vb;
+			if (fbase + k->frame_size > ctx->eval_depth_limit) {
+				err = ERROR_STACK;
+				goto fail;
+			}
+			stack_add(val);
+			frames_unwind(fbase, 1);
+			ctx->es.value_size = vbase;
+			for (i = 0; i < k->value_size; i++) {
+				value_push(k->values[i]);
 			}
-			vector_free(&vargs);
-			goto start_eval;
+			for (i = 0; i < k->frame_size; i++) {
+				struct frame *kf = &k->frames[i];
+				frame_push(kf->kind, kf->expr, kf->env, kf->args);
+				vb = vbase + (kf->vbase - k->vbase);
+				ctx->es.frames[ctx->es.frame_size - 1].vbase = vb;
+			}
+			goto ret;
+		}
+		err = ERROR_THROW;
+		ctx->throw_target = nil;
+		goto fail;
+	}
+	{
+		struct arc_vector vargs;
+		size_t i;
+		vector_new(&vargs);
+		for (i = argv; i < ctx->es.value_size; i++) {
+			vector_add(&vargs, ctx->es.values[i]);
+		}
+		if (fn.type == T_BUILTIN) {
+			VM_STAT(builtin_calls);
+			ctx->yield_ok = sched;
+			err = fn.value.builtin(&vargs, &val);
+			ctx->yield_ok = 0;
 		}
 		else {
-			err = apply(fn, &vargs, result);
-			vector_free(&vargs);
+			err = apply(fn, &vargs, &val);
 		}
-		stack_restore_add(ss, *result);
-		return err;
+		vector_free(&vargs);
+		if (err == ERROR_RETRY) { /* wait for input, then call it again */
+			ctx->cur_thread->state = TS_CALL;
+			ctx->cur_thread->argv = argv;
+			goto sched;
+		}
+		ctx->es.value_size = argv - 1;
+		if (err) goto fail;
+		goto ret;
+	}
+
+sched:
+	ctx->stack_size = ss;
+	t = thread_switch();
+	expr = t->expr;
+	env = t->env;
+	val = t->val;
+	t->expr = t->env = t->val = nil;
+	switch (t->state) {
+	case TS_EVAL:
+		goto eval;
+	case TS_RET:
+		goto ret;
+	case TS_CALL:
+		argv = t->argv;
+		fn = ctx->es.values[argv - 1];
+		tail = nil;
+		goto call;
+	}
+
+fail:
+	if (err == ERROR_THROW && !no(ctx->throw_target)) {
+		size_t d = cont_frame(ctx->throw_target);
+		if (d != (size_t)-1 && d >= fbase) { /* the escape ends in this run */
+			ctx->es.value_size = ctx->es.frames[d].vbase;
+			frames_unwind(d, 1);
+			val = ctx->thrown;
+			goto ret;
+		}
+	}
+	if (err != ERROR_THROW && ctx->backtrace.len == 0) backtrace_record();
+	if (sched && ctx->cur_thread != &ctx->main_thread) { /* the error ends the thread */
+		print_error(err);
+		ctx->cur_thread->dead = 1;
+		goto sched;
+	}
+	frames_unwind(fbase, err == ERROR_THROW);
+	ctx->es.value_size = vbase;
+	stack_restore(ss);
+	ctx->run_depth--;
+	return err;
+}
+
+error eval_expr(atom expr, atom env, atom *result)
+{
+	return eval_run(0, expr, env, ctx->es.value_size, nil, result);
+}
+
+/* Applies fn to argv[0..argc) followed by the elements of the list tail */
+error eval_apply(atom fn, atom *argv, size_t argc, atom tail, atom *result)
+{
+	size_t vbase = ctx->es.value_size, i;
+	value_push(fn);
+	for (i = 0; i < argc; i++) {
+		value_push(argv[i]);
 	}
+	return eval_run(1, nil, nil, vbase, tail, result);
 }
 
-void arc_init(char *file_path) {
+/* Creates an interpreter with the standard library loaded. The calling
+ * thread's current context is left unchanged. */
+struct arc_context *arc_context_new(void) {
+	struct arc_context *prev = ctx;
+	ctx = calloc(1, sizeof(struct arc_context));
+	ctx->eval_depth_limit = 1000000;
+	ctx->cur_thread = &ctx->main_thread;
+	ctx->sched_ticks = SCHED_SLICE;
+
 #ifdef READLINE
 	rl_bind_key('\t', rl_insert); /* prevent tab completion */
 #endif
 	srand((unsigned int)time(0));
-	env = env_create_cap(nil, 500);
-
-	symbol_capacity = 500;
-	symbol_table = malloc(symbol_capacity * sizeof(char *));
+	char *depth = getenv("ARCADIA_MAX_DEPTH");
+	if (depth && atol(depth) > 0) {
+		ctx->eval_depth_limit = atol(depth);
+	}
+	char *gctrace = getenv("ARCADIA_GCTRACE");
+	ctx->gc_trace = gctrace && atoi(gctrace) > 0;
+	ctx->start_time = now_seconds();
+	char *locations = getenv("ARCADIA_LOCATIONS");
+	ctx->locations = !(locations && atoi(locations) == 0);
+	ctx->src_file = -1;
+	ptr_map_new(&ctx->src_locs);
+	ptr_map_new(&ctx->fn_locs);
+	vector_new(&ctx->weak_tables);
+	string_new(&ctx->backtrace);
+	ctx->env = env_create_cap(nil, 500);
+
+	ctx->main_thread.fd = -1;
+	ctx->thread_capacity = 8;
+	ctx->threads = malloc(ctx->thread_capacity * sizeof(struct arc_thread *));
+	ctx->threads[ctx->thread_count++] = &ctx->main_thread;
+
+	ptr_map_new(&ctx->closure_names);
+	ptr_map_new(&ctx->prof_index);
+	ctx->sample_capacity = 64; /* a power of 2 */
+	ctx->samples = calloc(ctx->sample_capacity, sizeof(struct sample_entry));
+	ptr_map_new(&ctx->alloc_index);
+
+	ctx->symbol_capacity = 1024; /* a power of 2 */
+	ctx->symbol_table = calloc(ctx->symbol_capacity, sizeof(char *));
 
 	/* Set up the initial environment */
-	sym_t = make_sym("t");
-	sym_quote = make_sym("quote");
-	sym_quasiquote = make_sym("quasiquote");
-	sym_unquote = make_sym("unquote");
-	sym_unquote_splicing = make_sym("unquote-splicing");
-	sym_assign = make_sym("assign");
-	sym_fn = make_sym("fn");
-	sym_if = make_sym("if");
-	sym_mac = make_sym("mac");
-	sym_apply = make_sym("apply");
-	sym_cons = make_sym("cons");
-	sym_sym = make_sym("sym");
-	sym_string = make_sym("string");
-	sym_num = make_sym("num");
-	sym__ = make_sym("_");
-	sym_o = make_sym("o");
-	sym_table = make_sym("table");
-	sym_int = make_sym("int");
-	sym_char = make_sym("char");
-	sym_do = make_sym("do");
-
-	env_assign(env, sym_t.value.symbol, sym_t);
-	env_assign(env, make_sym("nil").value.symbol, nil);
-	env_assign(env, make_sym("car").value.symbol, make_builtin(builtin_car));
-	env_assign(env, make_sym("cdr").value.symbol, make_builtin(builtin_cdr));
-	env_assign(env, make_sym("cons").value.symbol, make_builtin(builtin_cons));
-	env_assign(env, make_sym("+").value.symbol, make_builtin(builtin_add));
-	env_assign(env, make_sym("-").value.symbol, make_builtin(builtin_subtract));
-	env_assign(env, make_sym("*").value.symbol, make_builtin(builtin_multiply));
-	env_assign(env, make_sym("/").value.symbol, make_builtin(builtin_divide));
-	env_assign(env, make_sym("<").value.symbol, make_builtin(builtin_less));
-	env_assign(env, make_sym(">").value.symbol, make_builtin(builtin_greater));
-	env_assign(env, make_sym("apply").value.symbol, make_builtin(builtin_apply));
-	env_assign(env, make_sym("is").value.symbol, make_builtin(builtin_is));
-	env_assign(env, make_sym("scar").value.symbol, make_builtin(builtin_scar));
-	env_assign(env, make_sym("scdr").value.symbol, make_builtin(builtin_scdr));
-	env_assign(env, make_sym("mod").value.symbol, make_builtin(builtin_mod));
-	env_assign(env, make_sym("type").value.symbol, make_builtin(builtin_type));
-	env_assign(env, make_sym("sref").value.symbol, make_builtin(builtin_sref));
-	env_assign(env, make_sym("writeb").value.symbol, make_builtin(builtin_writeb));
-	env_assign(env, make_sym("expt").value.symbol, make_builtin(builtin_expt));
-	env_assign(env, make_sym("log").value.symbol, make_builtin(builtin_log));
-	env_assign(env, make_sym("sqrt").value.symbol, make_builtin(builtin_sqrt));
-	env_assign(env, make_sym("readline").value.symbol, make_builtin(builtin_readline));
-	env_assign(env, make_sym("quit").value.symbol, make_builtin(builtin_quit));
-	env_assign(env, make_sym("rand").value.symbol, make_builtin(builtin_rand));
-	env_assign(env, make_sym("read").value.symbol, make_builtin(builtin_read));
-	env_assign(env, make_sym("macex").value.symbol, make_builtin(builtin_macex));
-	env_assign(env, make_sym("string").value.symbol, make_builtin(builtin_string));
-	env_assign(env, make_sym("sym").value.symbol, make_builtin(builtin_sym));
-	env_assign(env, make_sym("system").value.symbol, make_builtin(builtin_system));
-	env_assign(env, make_sym("eval").value.symbol, make_builtin(builtin_eval));
-	env_assign(env, make_sym("load").value.symbol, make_builtin(builtin_load));
-	env_assign(env, make_sym("int").value.symbol, make_builtin(builtin_int));
-	env_assign(env, make_sym("trunc").value.symbol, make_builtin(builtin_trunc));
-	env_assign(env, make_sym("sin").value.symbol, make_builtin(builtin_sin));
-	env_assign(env, make_sym("cos").value.symbol, make_builtin(builtin_cos));
-	env_assign(env, make_sym("tan").value.symbol, make_builtin(builtin_tan));
-	env_assign(env, make_sym("bound").value.symbol, make_builtin(builtin_bound));
-	env_assign(env, make_sym("infile").value.symbol, make_builtin(builtin_infile));
-	env_assign(env, make_sym("outfile").value.symbol, make_builtin(builtin_outfile));
-	env_assign(env, make_sym("close").value.symbol, make_builtin(builtin_close));
-	env_assign(env, make_sym("stdin").value.symbol, make_input(stdin));
-	env_assign(env, make_sym("stdout").value.symbol, make_output(stdout));
-	env_assign(env, make_sym("stderr").value.symbol, make_output(stderr));
-	env_assign(env, make_sym("disp").value.symbol, make_builtin(builtin_disp));
-	env_assign(env, make_sym("readb").value.symbol, make_builtin(builtin_readb));
-	env_assign(env, make_sym("sread").value.symbol, make_builtin(builtin_sread));
-	env_assign(env, make_sym("write").value.symbol, make_builtin(builtin_write));
-	env_assign(env, make_sym("newstring").value.symbol, make_builtin(builtin_newstring));
-	env_assign(env, make_sym("table").value.symbol, make_builtin(builtin_table));
-	env_assign(env, make_sym("maptable").value.symbol, make_builtin(builtin_maptable));
-	env_assign(env, make_sym("coerce").value.symbol, make_builtin(builtin_coerce));
-	env_assign(env, make_sym("flushout").value.symbol, make_builtin(builtin_flushout));
-	env_assign(env, make_sym("err").value.symbol, make_builtin(builtin_err));
-	env_assign(env, make_sym("len").value.symbol, make_builtin(builtin_len));
-	env_assign(env, make_sym("ccc").value.symbol, make_builtin(builtin_ccc));
-	env_assign(env, make_sym("pipe-from").value.symbol, make_builtin(builtin_pipe_from));
+	ctx->sym_t = make_sym("t");
+	ctx->sym_quote = make_sym("quote");
+	ctx->sym_quasiquote = make_sym("quasiquote");
+	ctx->sym_unquote = make_sym("unquote");
+	ctx->sym_unquote_splicing = make_sym("unquote-splicing");
+	ctx->sym_assign = make_sym("assign");
+	ctx->sym_fn = make_sym("fn");
+	ctx->sym_if = make_sym("if");
+	ctx->sym_mac = make_sym("mac");
+	ctx->sym_apply = make_sym("apply");
+	ctx->sym_cons = make_sym("cons");
+	ctx->sym_sym = make_sym("sym");
+	ctx->sym_string = make_sym("string");
+	ctx->sym_num = make_sym("num");
+	ctx->sym__ = make_sym("_");
+	ctx->sym_o = make_sym("o");
+	ctx->sym_table = make_sym("table");
+	ctx->sym_int = make_sym("int");
+	ctx->sym_char = make_sym("char");
+	ctx->sym_do = make_sym("do");
+
+	env_assign(ctx->env, ctx->sym_t.value.symbol, ctx->sym_t);
+	env_assign(ctx->env, make_sym("nil").value.symbol, nil);
+	env_assign(ctx->env, make_sym("car").value.symbol, make_builtin(builtin_car));
+	env_assign(ctx->env, make_sym("cdr").value.symbol, make_builtin(builtin_cdr));
+	env_assign(ctx->env, make_sym("cons").value.symbol, make_builtin(builtin_cons));
+	env_assign(ctx->env, make_sym("+").value.symbol, make_builtin(builtin_add));
+	env_assign(ctx->env, make_sym("-").value.symbol, make_builtin(builtin_subtract));
+	env_assign(ctx->env, make_sym("*").value.symbol, make_builtin(builtin_multiply));
+	env_assign(ctx->env, make_sym("/").value.symbol, make_builtin(builtin_divide));
+	env_assign(ctx->env, make_sym("<").value.symbol, make_builtin(builtin_less));
+	env_assign(ctx->env, make_sym(">").value.symbol, make_builtin(builtin_greater));
+	env_assign(ctx->env, make_sym("apply").value.symbol, make_builtin(builtin_apply));
+	env_assign(ctx->env, make_sym("is").value.symbol, make_builtin(builtin_is));
+	env_assign(ctx->env, make_sym("scar").value.symbol, make_builtin(builtin_scar));
+	env_assign(ctx->env, make_sym("scdr").value.symbol, make_builtin(builtin_scdr));
+	env_assign(ctx->env, make_sym("mod").value.symbol, make_builtin(builtin_mod));
+	env_assign(ctx->env, make_sym("type").value.symbol, make_builtin(builtin_type));
+	env_assign(ctx->env, make_sym("sref").value.symbol, make_builtin(builtin_sref));
+	env_assign(ctx->env, make_sym("writeb").value.symbol, make_builtin(builtin_writeb));
+	env_assign(ctx->env, make_sym("expt").value.symbol, make_builtin(builtin_expt));
+	env_assign(ctx->env, make_sym("log").value.symbol, make_builtin(builtin_log));
+	env_assign(ctx->env, make_sym("sqrt").value.symbol, make_builtin(builtin_sqrt));
+	env_assign(ctx->env, make_sym("readline").value.symbol, make_builtin(builtin_readline));
+	env_assign(ctx->env, make_sym("quit").value.symbol, make_builtin(builtin_quit));
+	env_assign(ctx->env, make_sym("rand").value.symbol, make_builtin(builtin_rand));
+	env_assign(ctx->env, make_sym("read").value.symbol, make_builtin(builtin_read));
+	env_assign(ctx->env, make_sym("macex").value.symbol, make_builtin(builtin_macex));
+	env_assign(ctx->env, make_sym("string").value.symbol, make_builtin(builtin_string));
+	env_assign(ctx->env, make_sym("sym").value.symbol, make_builtin(builtin_sym));
+	env_assign(ctx->env, make_sym("system").value.symbol, make_builtin(builtin_system));
+	env_assign(ctx->env, make_sym("eval").value.symbol, make_builtin(builtin_eval));
+	env_assign(ctx->env, make_sym("load").value.symbol, make_builtin(builtin_load));
+	env_assign(ctx->env, make_sym("int").value.symbol, make_builtin(builtin_int));
+	env_assign(ctx->env, make_sym("trunc").value.symbol, make_builtin(builtin_trunc));
+	env_assign(ctx->env, make_sym("sin").value.symbol, make_builtin(builtin_sin));
+	env_assign(ctx->env, make_sym("cos").value.symbol, make_builtin(builtin_cos));
+	env_assign(ctx->env, make_sym("tan").value.symbol, make_builtin(builtin_tan));
+	env_assign(ctx->env, make_sym("bound").value.symbol, make_builtin(builtin_bound));
+	env_assign(ctx->env, make_sym("infile").value.symbol, make_builtin(builtin_infile));
+	env_assign(ctx->env, make_sym("outfile").value.symbol, make_builtin(builtin_outfile));
+	env_assign(ctx->env, make_sym("close").value.symbol, make_builtin(builtin_close));
+	env_assign(ctx->env, make_sym("stdin").value.symbol, make_input(stdin));
+	env_assign(ctx->env, make_sym("stdout").value.symbol, make_output(stdout));
+	env_assign(ctx->env, make_sym("stderr").value.symbol, make_output(stderr));
+	env_assign(ctx->env, make_sym("disp").value.symbol, make_builtin(builtin_disp));
+	env_assign(ctx->env, make_sym("readb").value.symbol, make_builtin(builtin_readb));
+	env_assign(ctx->env, make_sym("sread").value.symbol, make_builtin(builtin_sread));
+	env_assign(ctx->env, make_sym("write").value.symbol, make_builtin(builtin_write));
+	env_assign(ctx->env, make_sym("newstring").value.symbol, make_builtin(builtin_newstring));
+	env_assign(ctx->env, make_sym("table").value.symbol, make_builtin(builtin_table));
+	env_assign(ctx->env, make_sym("weak-table").value.symbol, make_builtin(builtin_weak_table));
+	env_assign(ctx->env, make_sym("cache-table").value.symbol, make_builtin(builtin_cache_table));
+	env_assign(ctx->env, make_sym("maptable").value.symbol, make_builtin(builtin_maptable));
+	env_assign(ctx->env, make_sym("coerce").value.symbol, make_builtin(builtin_coerce));
+	env_assign(ctx->env, make_sym("flushout").value.symbol, make_builtin(builtin_flushout));
+	env_assign(ctx->env, make_sym("err").value.symbol, make_builtin(builtin_err));
+	env_assign(ctx->env, make_sym("len").value.symbol, make_builtin(builtin_len));
+	env_assign(ctx->env, make_sym("ccc").value.symbol, make_builtin(builtin_ccc));
+	env_assign(ctx->env, make_sym("call/ec").value.symbol, make_builtin(builtin_call_ec));
+	env_assign(ctx->env, make_sym("pipe-from").value.symbol, make_builtin(builtin_pipe_from));
+	env_assign(ctx->env, make_sym("pipe-to").value.symbol, make_builtin(builtin_pipe_to));
+	env_assign(ctx->env, make_sym("process").value.symbol, make_builtin(builtin_process));
+	env_assign(ctx->env, make_sym("ready?").value.symbol, make_builtin(builtin_readyp));
+	env_assign(ctx->env, make_sym("new-thread").value.symbol, make_builtin(builtin_new_thread));
+	env_assign(ctx->env, make_sym("current-thread").value.symbol, make_builtin(builtin_current_thread));
+	env_assign(ctx->env, make_sym("kill-thread").value.symbol, make_builtin(builtin_kill_thread));
+	env_assign(ctx->env, make_sym("dead").value.symbol, make_builtin(builtin_dead));
+	env_assign(ctx->env, make_sym("sleep").value.symbol, make_builtin(builtin_sleep));
+	env_assign(ctx->env, make_sym("msec").value.symbol, make_builtin(builtin_msec));
+	env_assign(ctx->env, make_sym("seconds").value.symbol, make_builtin(builtin_seconds));
+	env_assign(ctx->env, make_sym("current-process-milliseconds").value.symbol, make_builtin(builtin_current_process_milliseconds));
+	env_assign(ctx->env, make_sym("current-gc-milliseconds").value.symbol, make_builtin(builtin_current_gc_milliseconds));
+	env_assign(ctx->env, make_sym("atomic-invoke").value.symbol, make_builtin(builtin_atomic_invoke));
+	env_assign(ctx->env, make_sym("pmap").value.symbol, make_builtin(builtin_pmap));
+	env_assign(ctx->env, make_sym("pkeep").value.symbol, make_builtin(builtin_pkeep));
+	env_assign(ctx->env, make_sym("preduce").value.symbol, make_builtin(builtin_preduce));
+	env_assign(ctx->env, make_sym("fork-pool").value.symbol, make_builtin(builtin_fork_pool));
+	env_assign(ctx->env, make_sym("mmap-file").value.symbol, make_builtin(builtin_mmap_file));
+	env_assign(ctx->env, make_sym("instring").value.symbol, make_builtin(builtin_instring));
+	env_assign(ctx->env, make_sym("readbytes").value.symbol, make_builtin(builtin_readbytes));
+	env_assign(ctx->env, make_sym("writebytes").value.symbol, make_builtin(builtin_writebytes));
+	env_assign(ctx->env, make_sym("setvbuf").value.symbol, make_builtin(builtin_setvbuf));
+	env_assign(ctx->env, make_sym("flush").value.symbol, make_builtin(builtin_flush));
+	env_assign(ctx->env, make_sym("pr").value.symbol, make_builtin(builtin_pr));
+	env_assign(ctx->env, make_sym("prn").value.symbol, make_builtin(builtin_prn));
+	env_assign(ctx->env, make_sym("profile-start").value.symbol, make_builtin(builtin_profile_start));
+	env_assign(ctx->env, make_sym("profile-report").value.symbol, make_builtin(builtin_profile_report));
+	env_assign(ctx->env, make_sym("profile-sample").value.symbol, make_builtin(builtin_profile_sample));
+	env_assign(ctx->env, make_sym("profile-folded").value.symbol, make_builtin(builtin_profile_folded));
+	env_assign(ctx->env, make_sym("profile-alloc").value.symbol, make_builtin(builtin_profile_alloc));
+	env_assign(ctx->env, make_sym("profile-alloc-report").value.symbol, make_builtin(builtin_profile_alloc_report));
+	env_assign(ctx->env, make_sym("gc-stats").value.symbol, make_builtin(builtin_gc_stats));
+	env_assign(ctx->env, make_sym("open-ports").value.symbol, make_builtin(builtin_open_ports));
+	env_assign(ctx->env, make_sym("vm-stats").value.symbol, make_builtin(builtin_vm_stats));
+	env_assign(ctx->env, make_sym("marshal").value.symbol, make_builtin(builtin_marshal));
+	env_assign(ctx->env, make_sym("unmarshal").value.symbol, make_builtin(builtin_unmarshal));
 
 #include "library.h"
 
-	error err = load_string(stdlib);
+	atom result;
+	error err = load_string(stdlib, &result);
 	if (err) {
 		print_error(err);
 	}
+
+	/* remember the standard definitions, which need not be copied to workers */
+	struct arc_table *globals = cdr(ctx->env).value.table;
+	size_t i;
+	ctx->initial_globals = make_table(globals->capacity);
+	for (i = 0; i < globals->capacity; i++) {
+		struct table_entry *e;
+		for (e = globals->data[i]; e; e = e->next) {
+			table_add(ctx->initial_globals.value.table, e->k, e->v);
+		}
+	}
+
+	struct arc_context *c = ctx;
+	ctx = prev;
+	return c;
+}
+
+/* Frees c and everything allocated by the interpreter it holds */
+void arc_context_free(struct arc_context *c) {
+	struct arc_context *prev = ctx;
+	size_t i;
+#ifndef _WIN32
+	if (c->pool) pool_free(c->pool);
+#endif
+	ctx = c;
+	for (i = 0; i < c->thread_count; i++) {
+		struct arc_thread *t = c->threads[i];
+		if (t != c->cur_thread) {
+			free(t->es.frames);
+			free(t->es.values);
+		}
+	}
+	free(c->threads);
+	ptr_map_free(&c->closure_names);
+	ptr_map_free(&c->prof_index);
+	sample_stop(); /* lets another context sample */
+	samples_clear();
+	free(c->samples);
+	ptr_map_free(&c->alloc_index);
+	free(c->alloc_sites);
+	ptr_map_free(&c->src_locs);
+	ptr_map_free(&c->fn_locs);
+	vector_free(&c->weak_tables);
+	for (i = 0; i < c->src_file_count; i++)
+		free(c->src_files[i]);
+	free(c->src_files);
+	free(c->backtrace.str);
+	free(c->prof);
+	free(c->es.frames);
+	free(c->es.values);
+	gc_sweep(); /* nothing is marked, so this also closes the ports */
+	free(c->reap_pids);
+	for (i = 0; i < c->symbol_capacity; i++) {
+		free(c->symbol_table[i]);
+	}
+	free(c->symbol_table);
+	free(c->stack);
+	free(c);
+	ctx = prev == c ? NULL : prev;
+}
+
+/* Makes c the context that the functions of the interpreter called from
+ * this thread work on. A context must not be current in two threads at once. */
+void arc_context_set(struct arc_context *c) {
+	ctx = c;
+}
+
+struct arc_context *arc_context_get(void) {
+	return ctx;
+}
+
+/* The functions of the embedding API make their context current while they
+ * run, so that they may be called from any thread. */
+
+error arc_load_file(struct arc_context *c, const char *path) {
+	struct arc_context *prev = ctx;
+	error err;
+	ctx = c;
+	err = load_file(path);
+	ctx = prev;
+	return err;
+}
+
+error arc_eval_string(struct arc_context *c, const char *text, atom *result) {
+	struct arc_context *prev = ctx;
+	error err;
+	ctx = c;
+	int ss = ctx->stack_size;
+	err = load_string(text, result);
+	stack_restore_add(ss, *result);
+	ctx = prev;
+	return err;
+}
+
+error arc_call(struct arc_context *c, atom fn, atom *argv, size_t argc, atom *result) {
+	struct arc_context *prev = ctx;
+	error err;
+	ctx = c;
+	int ss = ctx->stack_size;
+	err = eval_apply(fn, argv, argc, nil, result);
+	if (err) *result = nil;
+	stack_restore_add(ss, *result);
+	ctx = prev;
+	return err;
+}
+
+void arc_define(struct arc_context *c, const char *name, atom value) {
+	struct arc_context *prev = ctx;
+	ctx = c;
+	env_assign(ctx->env, make_sym(name).value.symbol, value);
+	ctx = prev;
+}
+
+void arc_define_builtin(struct arc_context *c, const char *name, arc_builtin fn) {
+	arc_define(c, name, make_builtin(fn));
+}
+
+error arc_lookup(struct arc_context *c, const char *name, atom *result) {
+	struct arc_context *prev = ctx;
+	error err;
+	ctx = c;
+	err = env_get(ctx->env, make_sym(name).value.symbol, result);
+	ctx = prev;
+	return err;
+}
+
+atom arc_make_number(double x) {
+	return make_number(x);
+}
+
+atom arc_make_string(struct arc_context *c, const char *s) {
+	struct arc_context *prev = ctx;
+	atom a;
+	ctx = c;
+	a = make_string(strdup(s));
+	ctx = prev;
+	return a;
+}
+
+atom arc_make_symbol(struct arc_context *c, const char *s) {
+	struct arc_context *prev = ctx;
+	atom a;
+	ctx = c;
+	a = make_sym(s);
+	ctx = prev;
+	return a;
+}
+
+atom arc_cons(struct arc_context *c, atom car_val, atom cdr_val) {
+	struct arc_context *prev = ctx;
+	atom a;
+	ctx = c;
+	a = cons(car_val, cdr_val);
+	ctx = prev;
+	return a;
+}
+
+atom arc_car(atom a) {
+	return a.type == T_CONS ? car(a) : nil;
+}
+
+atom arc_cdr(atom a) {
+	return a.type == T_CONS ? cdr(a) : nil;
+}
+
+double arc_to_number(atom a) {
+	return a.type == T_NUM ? a.value.number : 0;
+}
+
+const char *arc_to_string(atom a) {
+	if (a.type == T_STRING) return a.value.str->value;
+	if (a.type == T_SYM) return a.value.symbol;
+	return NULL;
+}
+
+char *arc_repr(struct arc_context *c, atom a) {
+	struct arc_context *prev = ctx;
+	char *s;
+	ctx = c;
+	s = to_string(a, 1);
+	ctx = prev;
+	return s;
 }
 
 char *get_dir_path(char *file_path) {
@@ -2785,7 +6292,12 @@ char *get_dir_path(char *file_path) {
 void print_error(error e) {
 	if (e != ERROR_USER) {
 		printf("%s : ", error_string[e]);
-		print_expr(cur_expr);
+		print_expr(ctx->cur_expr);
 		puts("");
 	}
+	if (ctx->backtrace.len > 0) {
+		fputs(ctx->backtrace.str, stdout);
+		ctx->backtrace.len = 0;
+		ctx->backtrace.str[0] = 0;
+	}
 }
@@ -12,11 +12,12 @@
 #include <stddef.h>
 #include <math.h>
 #include <time.h>
-#include <setjmp.h>
 
 #ifdef READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
+#else
+#define readline(prompt) readline_fp(prompt, stdin)
 #endif
 
 #ifdef _MSC_VER
@@ -25,118 +26,344 @@
 #define pclose _pclose
 #endif
 
-enum type {
-	T_NIL, 
-	T_CONS,
-	T_SYM,
-	T_NUM,
-	T_BUILTIN,
-	T_CLOSURE,
-	T_MACRO,
-	T_STRING,
-	T_INPUT,
-	T_INPUT_PIPE,
-	T_OUTPUT,
-	T_TABLE,
-	T_CHAR,
-	T_CONTINUATION
-};
-
-typedef enum {
-  ERROR_OK = 0, ERROR_SYNTAX, ERROR_UNBOUND, ERROR_ARGS, ERROR_TYPE, ERROR_FILE, ERROR_USER
-} error;
-
-typedef struct atom atom;
-struct vector;
-typedef error(*builtin)(struct vector *vargs, atom *result);
-
-struct atom {
-	enum type type;
-
-	union {
-		double number;
-		struct pair *pair;
-		char *symbol;
-		struct str *str;
-		builtin builtin;
-		FILE *fp;
-		struct table *table;
-		char ch;
-		jmp_buf *jb;
-	} value;
-};
-
-struct vector {
-	atom *data;
-	atom static_data[8]; /* small size optimization */
-	size_t capacity, size;
-};
-
-struct pair {
-	struct atom car, cdr;
+#include "arcadia.h"
+
+/* the embedding API's types under their internal names */
+typedef arc_error error;
+typedef arc_atom atom;
+
+struct arc_pair {
+	atom car, cdr;
 	char mark;
-	struct pair *next;
+	struct arc_pair *next;
 };
 
-struct str {
-	char *value;
+struct arc_str {
+	char *value; /* followed by a 0 byte */
+	size_t len; /* bytes in value, which may include 0 bytes */
+	char mapped; /* value is a read-only file mapping */
 	char mark;
-	struct str *next;
+	struct arc_str *next;
 };
 
 struct table_entry {
-	struct atom k, v;
+	atom k, v;
 	struct table_entry *next;
 };
 
-struct table {
+enum table_kind {
+	TABLE_PLAIN,
+	TABLE_WEAK,  /* gc drops the entries whose keys are otherwise unreachable */
+	TABLE_CACHE  /* a cache_table */
+};
+
+struct arc_table {
 	size_t capacity;
 	size_t size;
 	struct table_entry **data;
 	char mark;
-	struct table *next;
+	char kind; /* enum table_kind */
+	struct arc_table *next;
+};
+
+/* entry of a cache_table */
+struct lru_entry {
+	struct table_entry e;
+	struct lru_entry *newer, *older;
+};
+
+/* table that drops its least recently used entry when it grows past limit */
+struct cache_table {
+	struct arc_table t;
+	size_t limit;
+	struct lru_entry *newest, *oldest;
+};
+
+/* pending work of the evaluator */
+enum frame_kind {
+	F_IF,     /* args: clauses starting at the condition being evaluated */
+	F_ASSIGN, /* expr: symbol being assigned */
+	F_DO,     /* args: forms after the one being evaluated */
+	F_ARGS,   /* expr: call form, args: forms not yet evaluated */
+	F_CCC,    /* args: continuation captured by ccc */
+	F_ESCAPE, /* args: escape continuation of call/ec */
+	F_CALL    /* expr: closure being profiled, env: caller's profile entry, args: start time;
+	             env and args are nil when only sampling */
+};
+
+struct frame {
+	enum frame_kind kind;
+	atom expr, env, args;
+	size_t vbase; /* index of this frame's first value on the value stack */
+#ifdef ARC_STATS
+	size_t body; /* vm_body when the frame was pushed */
+#endif
+};
+
+/* frames and evaluated operands of calls in progress */
+struct eval_stack {
+	struct frame *frames;
+	size_t frame_size, frame_capacity;
+	atom *values;
+	size_t value_size, value_capacity;
+};
+
+/* A continuation captured by ccc. While its F_CCC frame is on the stack it
+ * is live and invoking it unwinds to that frame. Once the frame is gone the
+ * frames below it, down to the start of the run that captured it, are kept
+ * as a copy that invoking it reinstates; unless it is not captured, when
+ * nothing can invoke it any more. */
+struct arc_continuation {
+	int live;
+	int captured; /* may be reachable once its F_CCC frame is gone */
+	size_t depth;        /* index of the F_CCC frame while live */
+	size_t fbase, vbase; /* start of the capturing run's frames and values */
+	struct frame *frames;
+	size_t frame_size;
+	atom *values;
+	size_t value_size;
+	struct arc_thread *thread; /* thread whose stack holds the F_CCC frame */
+	char mark;
+	struct arc_continuation *next;
+};
+
+/* where a suspended thread resumes */
+enum thread_state {
+	TS_EVAL, /* evaluate expr in env */
+	TS_RET,  /* return val to the top frame */
+	TS_CALL  /* call the function at es.values[argv - 1] again */
+};
+
+/* A green thread. The running thread's stack is es; the others keep theirs
+ * here. Threads are switched only by the outermost run of the evaluator. */
+struct arc_thread {
+	struct eval_stack es;
+	enum thread_state state;
+	atom expr, env, val;
+	size_t argv;
+	double wake; /* time before which a sleeping thread does not run */
+	int fd;      /* descriptor the thread waits to become readable, or -1 */
+	int dead;
+	char mark;
+	struct arc_thread *next;
+};
+
+/* identity map from pointers to atoms, with open addressing */
+struct ptr_map {
+	void **keys;
+	atom *values;
+	size_t size, capacity;
+};
+
+/* objects allocated while evaluating one form, by the allocation profiler */
+struct alloc_site {
+	atom form; /* nil for allocations outside any form */
+	double objects, bytes; /* estimated from the samples */
+};
+
+/* what the collector has done, for gc-stats */
+struct gc_stats {
+	unsigned long collections;
+	double pause_total, pause_max; /* seconds */
+	size_t allocated; /* objects allocated before the last collection */
+	/* found live by the last collection */
+	size_t pairs, strings, tables;
+	size_t string_bytes, table_bytes;
+};
+
+/* samples of one folded stack, by the sampling profiler */
+struct sample_entry {
+	char *stack; /* closure names, outermost first, separated by ';' */
+	unsigned long count;
+};
+
+/* time spent in the closures assigned to one name, by the profiler */
+struct prof_entry {
+	atom name; /* nil for closures never assigned to a name */
+	unsigned long calls;
+	double total, self; /* seconds, with and without the calls it made */
+	int active; /* calls in progress; recursion counts in total once */
 };
 
+#ifdef ARC_STATS
+/* what the evaluator did, for vm-stats */
+struct vm_stats {
+	unsigned long evals, evals_symbol, evals_self, evals_form;
+	unsigned long sf_if, sf_assign, sf_quote, sf_fn, sf_do, sf_mac; /* special forms */
+	unsigned long builtin_calls, closure_calls, tail_calls;
+	unsigned long env_gets, env_scopes; /* lookups, and scopes searched */
+	unsigned long table_gets, table_probes; /* lookups, and entries compared */
+	unsigned long vector_spills; /* vectors grown past static_data */
+};
+#endif
+
 /* simple string with length and capacity */
 struct string {
 	char *str;
 	size_t len, cap;
 };
 
+/* The whole state of one interpreter. Interpreters share nothing, so each
+ * may run on its own OS thread. The functions of arc.c work on the calling
+ * thread's current context; see arc_context_set. */
+struct arc_context {
+	/* values being built by C code, kept from the gc */
+	atom *stack;
+	size_t stack_size, stack_capacity;
+
+	/* heap */
+	struct arc_pair *pair_head;
+	struct arc_str *str_head;
+	struct arc_table *table_head;
+	struct arc_continuation *cont_head;
+	struct arc_thread *thread_head;
+	struct arc_vector weak_tables; /* weak tables marked by the current gc */
+	size_t alloc_count, alloc_count_old;
+	struct gc_stats gc_stats;
+	int gc_trace; /* log each collection to stderr */
+	double start_time;
+
+	char **symbol_table; /* interned names, open addressing */
+	size_t symbol_size, symbol_capacity;
+	atom env; /* the global environment */
+	/* symbols for faster execution */
+	atom sym_t, sym_quote, sym_quasiquote, sym_unquote, sym_unquote_splicing, sym_assign, sym_fn, sym_if, sym_mac, sym_apply, sym_cons, sym_sym, sym_string, sym_num, sym__, sym_o, sym_table, sym_int, sym_char, sym_do;
+
+	/* evaluator */
+	atom cur_expr;
+	atom thrown, throw_target; /* value and continuation of an escape across runs */
+	size_t escape_serial;
+	struct eval_stack es;
+	size_t eval_depth_limit; /* maximum number of evaluator frames */
+
+	/* green threads */
+	struct arc_thread main_thread;
+	struct arc_thread *cur_thread;
+	struct arc_thread **threads; /* threads that have not finished, in scheduling order */
+	size_t thread_count, thread_capacity;
+	int run_depth; /* nesting of eval_run; threads are switched only at depth 1 */
+	int yield_ok; /* the builtin being called may suspend its thread */
+	int yield_pending; /* switch threads at the next safepoint */
+	long sched_ticks;
+
+	/* parallel jobs */
+	atom initial_globals; /* global bindings as the standard library left them */
+	struct worker_pool *pool; /* created by the first parallel job */
+	int worker; /* this interpreter is a worker of a pool */
+
+	/* ports */
+	struct arc_port *port_head;
+	size_t open_ports; /* opened and not closed, besides stdin, stdout and stderr */
+	int *reap_pids; /* children of collected ports that had not exited */
+	size_t reap_count, reap_capacity;
+
+	/* profiler */
+	struct ptr_map closure_names; /* closure -> name it was first assigned to */
+	int profiling;
+	struct prof_entry *prof;
+	size_t prof_count, prof_capacity;
+	struct ptr_map prof_index; /* name symbol -> index in prof */
+	long prof_cur; /* entry of the closure running, or -1 */
+	double prof_last; /* time of the last call or return */
+	int sampling;
+	struct sample_entry *samples; /* open addressing by stack */
+	size_t sample_count, sample_capacity;
+	unsigned long alloc_sample; /* record one allocation in this many, 0 if off */
+	unsigned long alloc_countdown;
+	struct alloc_site *alloc_sites;
+	size_t alloc_site_count, alloc_site_capacity;
+	struct ptr_map alloc_index; /* form -> index in alloc_sites */
+
+	/* source locations */
+	int locations; /* record them, unless ARCADIA_LOCATIONS=0 */
+	struct ptr_map src_locs; /* form -> src_file index * 2^32 + line */
+	struct ptr_map fn_locs; /* closure body (see closure_key) -> location of its fn form */
+	char **src_files;
+	size_t src_file_count, src_file_capacity;
+	long src_file; /* index of the file being loaded, or -1 */
+	const char *src_pos; /* how far the reader has counted lines */
+	long src_line; /* line of src_pos */
+	struct string backtrace; /* of the last error, until print_error */
+
+#ifdef ARC_STATS
+	struct vm_stats vm_stats;
+	size_t vm_body; /* frame_size where the running closure's body started */
+#endif
+};
+
+/* an input or output port. An unreachable port is closed by gc. */
+struct arc_port {
+	FILE *fp; /* NULL once closed */
+	atom s; /* string that an instring port reads, or nil */
+	char *buf; /* buffer given to setvbuf, or NULL */
+	int pid; /* child process the port talks to, or 0 */
+	char popened; /* closed with pclose */
+	char borrowed; /* copied from another context, which closes it */
+	char mark;
+	struct arc_port *next;
+};
+
 /* forward declarations */
-error apply(atom fn, struct vector *vargs, atom *result);
+error apply(atom fn, struct arc_vector *vargs, atom *result);
+error eval_apply(atom fn, atom *argv, size_t argc, atom tail, atom *result);
+void frames_unwind(size_t to, int seal);
+int thread_wait_input(FILE *fp);
 int listp(atom expr);
 char *slurp_fp(FILE *fp);
 char *slurp(const char *path);
 error eval_expr(atom expr, atom env, atom *result);
 void gc_mark(atom root);
 void gc();
+void gc_sweep();
+void pool_free(struct worker_pool *pool);
+double now_seconds();
+double process_seconds();
+void profile_start(void);
+void profile_report(FILE *fp);
+int sample_start(double interval);
+void sample_stop(void);
+void sample_report(FILE *fp);
+void alloc_profile_start(unsigned long every);
+void alloc_profile_report(FILE *fp);
 error macex(atom expr, atom *result);
 char *to_string(atom a, int write);
+void to_string_cat(struct string *s, atom a, int write);
 void string_new(struct string* dst);
+void string_putc(struct string *dst, char c);
 void string_cat(struct string *dst, char *src);
+void string_cat_len(struct string *dst, const char *src, size_t n);
 error macex_eval(atom expr, atom *result);
-error arc_load_file(const char *path);
+error load_file(const char *path);
+error load_string(const char *text, atom *result);
+error marshal(struct string *b, atom a);
+error unmarshal_fp(FILE *fp, atom *result);
 char *get_dir_path(char *file_path);
-void arc_init(char *file_path);
-#ifndef READLINE
-char *readline(char *prompt);
-#endif
 char *readline_fp(char *prompt, FILE *fp);
 error read_expr(const char *input, const char **end, atom *result);
+error read_text_fp(FILE *fp, struct string *s);
+error read_fp(FILE *fp, atom *result);
+void print_fp(atom a, int write, FILE *fp);
 void print_expr(atom a);
 void print_error(error e);
 int is(atom a, atom b);
 int iso(atom a, atom b);
 size_t hash_code(atom a);
 atom make_table(size_t capacity);
-void table_add(struct table *tbl, atom k, atom v);
-struct table_entry *table_get(struct table *tbl, atom k);
-struct table_entry *table_get_sym(struct table *tbl, char *k);
-int table_set(struct table *tbl, atom k, atom v);
-int table_set_sym(struct table *tbl, char *k, atom v);
+atom make_weak_table(size_t capacity);
+atom make_cache_table(size_t limit);
+void table_add(struct arc_table *tbl, atom k, atom v);
+struct table_entry *table_get(struct arc_table *tbl, atom k);
+struct table_entry *table_get_sym(struct arc_table *tbl, char *k);
+int table_set(struct arc_table *tbl, atom k, atom v);
+int table_set_sym(struct arc_table *tbl, char *k, atom v);
 void consider_gc();
 atom cons(atom car_val, atom cdr_val);
+atom make_number(double x);
+atom make_sym(const char *s);
+atom make_sym_len(const char *s, size_t len);
+atom make_builtin(arc_builtin fn);
+atom make_string(char *x);
+atom make_string_len(char *x, size_t len);
 /* end forward */
 
 #define car(p) ((p).value.pair->car)
@@ -61,7 +61,7 @@ int main(int argc, char **argv)
 {
 	if (argc == 1) { /* REPL */
 		print_logo();
-		arc_init(argv[0]);
+		arc_context_set(arc_context_new());
 		repl();
 		puts("");
 		return 0;
@@ -72,8 +72,14 @@ int main(int argc, char **argv)
 			puts("Usage: arcadia [OPTIONS...] [FILES...]");
 			puts("");
 			puts("OPTIONS:");
-			puts("    -h    print this screen.");
-			puts("    -v    print version.");
+			puts("    -h         print this screen.");
+			puts("    -v         print version.");
+			puts("    --profile  print a profile of the functions called to stderr.");
+			puts("    --profile-alloc");
+			puts("               print the forms that allocate the most to stderr.");
+			puts("    --sample=FILE");
+			puts("               write sampled stacks of the functions called to FILE, folded");
+			puts("               for flamegraph.pl.");
 			return 0;
 		}
 		else if (strcmp(opt, "-v") == 0) {
@@ -83,16 +89,45 @@ int main(int argc, char **argv)
 	}
 
 	/* execute files */
-	arc_init(argv[0]);
+	struct arc_context *c = arc_context_new();
+	arc_context_set(c);
 	int i;
+	int profile = 0, profile_alloc = 0;
+	char *sample = NULL;
 	error err;
 	for (i = 1; i < argc; i++) {
-		err = arc_load_file(argv[i]);
+		if (strcmp(argv[i], "--profile") == 0) {
+			profile = 1;
+			profile_start();
+			continue;
+		}
+		if (strcmp(argv[i], "--profile-alloc") == 0) {
+			profile_alloc = 1;
+			alloc_profile_start(16);
+			continue;
+		}
+		if (strncmp(argv[i], "--sample=", 9) == 0) {
+			sample = argv[i] + 9;
+			sample_start(0.01);
+			continue;
+		}
+		err = arc_load_file(c, argv[i]);
 		if (err) {
 			fprintf(stderr, "In file %s:\n", argv[i]);
 			print_error(err);
 			break;
 		}
 	}
+	if (profile) profile_report(stderr);
+	if (profile_alloc) alloc_profile_report(stderr);
+	if (sample) {
+		FILE *fp = fopen(sample, "w");
+		sample_stop();
+		if (fp) {
+			sample_report(fp);
+			fclose(fp);
+		}
+		else perror(sample);
+	}
 	return 0;
 }
@@ -0,0 +1,126 @@
+#pragma once
+#ifndef _INC_ARCADIA
+#define _INC_ARCADIA
+
+/* Embedding API of libarcadia.
+ *
+ *   struct arc_context *c = arc_context_new();
+ *   arc_define_builtin(c, "twice", builtin_twice);
+ *   arc_atom result;
+ *   if (arc_eval_string(c, "(twice 21)", &result) == ERROR_OK)
+ *       printf("%g\n", arc_to_number(result));
+ *   arc_context_free(c);
+ *
+ * A builtin receives its arguments in vargs->data[0..vargs->size):
+ *
+ *   arc_error builtin_twice(struct arc_vector *vargs, arc_atom *result) {
+ *       if (vargs->size != 1) return ERROR_ARGS;
+ *       if (vargs->data[0].type != T_NUM) return ERROR_TYPE;
+ *       *result = arc_make_number(vargs->data[0].value.number * 2);
+ *       return ERROR_OK;
+ *   }
+ *
+ * Builtins run with their context current. A value returned by a function
+ * below stays reachable until the next call that evaluates code in the same
+ * context; keep it longer by binding it with arc_define.
+ *
+ * A context may be used from any thread, but from one thread at a time.
+ * The header may be included from C++. */
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define ARC_API __attribute__((visibility("default")))
+#else
+#define ARC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum arc_type {
+	T_NIL,
+	T_CONS,
+	T_SYM,
+	T_NUM,
+	T_BUILTIN,
+	T_CLOSURE,
+	T_MACRO,
+	T_STRING,
+	T_INPUT,
+	T_INPUT_PIPE,
+	T_OUTPUT,
+	T_TABLE,
+	T_CHAR,
+	T_CONTINUATION,
+	T_ESCAPE,
+	T_THREAD
+};
+
+typedef enum {
+  ERROR_OK = 0, ERROR_SYNTAX, ERROR_UNBOUND, ERROR_ARGS, ERROR_TYPE, ERROR_FILE, ERROR_USER, ERROR_STACK, ERROR_THROW,
+  ERROR_RETRY /* internal: a builtin would block, run it again later */
+} arc_error;
+
+typedef struct arc_atom arc_atom;
+struct arc_vector;
+typedef arc_error(*arc_builtin)(struct arc_vector *vargs, arc_atom *result);
+
+struct arc_atom {
+	enum arc_type type;
+
+	union {
+		double number;
+		struct arc_pair *pair;
+		char *symbol;
+		struct arc_str *str;
+		arc_builtin builtin;
+		struct arc_port *port;
+		struct arc_table *table;
+		char ch;
+		struct arc_continuation *cont;
+		struct arc_thread *thread;
+		size_t serial; /* T_ESCAPE */
+	} value;
+};
+
+struct arc_vector {
+	arc_atom *data;
+	arc_atom static_data[8]; /* small size optimization */
+	size_t capacity, size;
+};
+
+/* contexts; the functions of arc.c work on the calling thread's current one */
+ARC_API struct arc_context *arc_context_new(void);
+ARC_API void arc_context_free(struct arc_context *c);
+ARC_API void arc_context_set(struct arc_context *c);
+ARC_API struct arc_context *arc_context_get(void);
+
+/* loads the file at path */
+ARC_API arc_error arc_load_file(struct arc_context *c, const char *path);
+/* evaluates the expressions in text in order; result is the last value */
+ARC_API arc_error arc_eval_string(struct arc_context *c, const char *text, arc_atom *result);
+/* calls fn with argv[0..argc) */
+ARC_API arc_error arc_call(struct arc_context *c, arc_atom fn, arc_atom *argv, size_t argc, arc_atom *result);
+/* global variables */
+ARC_API void arc_define(struct arc_context *c, const char *name, arc_atom value);
+ARC_API void arc_define_builtin(struct arc_context *c, const char *name, arc_builtin fn);
+ARC_API arc_error arc_lookup(struct arc_context *c, const char *name, arc_atom *result);
+
+/* values */
+ARC_API arc_atom arc_make_number(double x);
+ARC_API arc_atom arc_make_string(struct arc_context *c, const char *s); /* copies s */
+ARC_API arc_atom arc_make_symbol(struct arc_context *c, const char *s);
+ARC_API arc_atom arc_cons(struct arc_context *c, arc_atom car, arc_atom cdr);
+ARC_API arc_atom arc_car(arc_atom a); /* nil if a is not a pair */
+ARC_API arc_atom arc_cdr(arc_atom a);
+ARC_API double arc_to_number(arc_atom a); /* 0 if a is not a number */
+ARC_API const char *arc_to_string(arc_atom a); /* contents of a string or symbol, or NULL */
+ARC_API char *arc_repr(struct arc_context *c, arc_atom a); /* as written by write; free after use */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+/* Runs each benchmark program several times and prints, as JSON, the
+ * median wall and user time of its runs and its peak resident set size.
+ *
+ *   bench/bench [-n runs] ./arcadia bench/fib.arc bench/tak.arc ...
+ *
+ * The programs' output goes to /dev/null. POSIX only. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double median(double *xs, int n) {
+	qsort(xs, n, sizeof(double), compare_double);
+	return n % 2 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+}
+
+/* Runs interpreter on path once. Returns 0 if it exited with status 0. */
+static int run(const char *interpreter, const char *path, double *wall, double *user, long *max_rss_kb) {
+	struct rusage ru;
+	int status;
+	double start = now_seconds();
+	pid_t pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) dup2(null, STDOUT_FILENO);
+		execl(interpreter, interpreter, path, (char *)NULL);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0) return -1;
+	*wall = now_seconds() - start;
+	*user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+#ifdef __APPLE__
+	*max_rss_kb = ru.ru_maxrss / 1024; /* bytes */
+#else
+	*max_rss_kb = ru.ru_maxrss;
+#endif
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* name of a benchmark: its file name without directory and extension */
+static void bench_name(const char *path, char *name, size_t size) {
+	const char *base = strrchr(path, '/'), *dot;
+	size_t len;
+	base = base ? base + 1 : path;
+	dot = strrchr(base, '.');
+	len = dot ? (size_t)(dot - base) : strlen(base);
+	if (len >= size) len = size - 1;
+	memcpy(name, base, len);
+	name[len] = 0;
+}
+
+int main(int argc, char **argv) {
+	int runs = 5, i = 1, j, failed = 0, first = 1;
+	const char *interpreter;
+	double *walls, *users;
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		runs = atoi(argv[2]);
+		i = 3;
+	}
+	if (runs < 1 || argc - i < 2) {
+		fprintf(stderr, "Usage: %s [-n runs] interpreter program...\n", argv[0]);
+		return 2;
+	}
+	interpreter = argv[i++];
+	walls = malloc(runs * sizeof(double));
+	users = malloc(runs * sizeof(double));
+
+	printf("{\"runs\": %d, \"benchmarks\": [", runs);
+	for (; i < argc; i++) {
+		char name[256];
+		long max_rss_kb = 0;
+		int ok = 1;
+		double wall, user;
+		for (j = 0; j < runs; j++) {
+			long rss = 0;
+			walls[j] = users[j] = 0;
+			if (run(interpreter, argv[i], &walls[j], &users[j], &rss) != 0) ok = 0;
+			if (rss > max_rss_kb) max_rss_kb = rss;
+		}
+		wall = median(walls, runs); /* sorts walls */
+		user = median(users, runs);
+		bench_name(argv[i], name, sizeof(name));
+		printf("%s\n  {\"name\": \"%s\", \"median\": %.4f, \"min\": %.4f, \"user\": %.4f, \"max_rss_kb\": %ld, \"ok\": %s}",
+			first ? "" : ",", name, wall, walls[0], user, max_rss_kb, ok ? "true" : "false");
+		first = 0;
+		fflush(stdout);
+		if (!ok) failed = 1;
+	}
+	printf("\n]}\n");
+	free(walls);
+	free(users);
+	return failed;
+}
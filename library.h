@@ -227,13 +227,6 @@ const char* stdlib = "(mac = args (cons 'assign args))\n"
 "\n"
 "(mac do1 xs `(let it ,(car xs) ,@(cdr xs) it))\n"
 "\n"
-"(def pr args\n"
-"	\"Prints all its 'args' to screen. Returns the first arg.\"\n"
-"  (map1 disp args)\n"
-"  (car args))\n"
-"\n"
-"(def prn xs (do1 (apply pr xs) (writeb 10)))\n"
-"\n"
 "(mac for (var init max . body)\n"
 "  (w/uniq g\n"
 "  `(let ,g ,max (= ,var ,init)\n"
@@ -966,7 +959,7 @@ const char* stdlib = "(mac = args (cons 'assign args))\n"
 "\n"
 "(mac point (name . body)\n"
 "\"Like [[do]], but may be exited by calling 'name' from within 'body'.\"\n"
-"  `(ccc (fn (,name) ,@body)))\n"
+"  `(call/ec (fn (,name) ,@body)))\n"
 "\n"
 "(mac catch body\n"
 "\"Runs 'body', but any call to (throw x) immediately returns x.\"\n"
@@ -1016,12 +1009,63 @@ const char* stdlib = "(mac = args (cons 'assign args))\n"
 "	\"Inserts 'x' between the elements of 'ys'.\"\n"
 "	(and ys(cons(car ys)\n"
 "	(mappend[list x _](cdr ys)))))\n"
-"(def memo (f)\n"
+"(def memo (f (o cache (table)))\n"
 "\"Turns function 'f' into a _memoized_ version that also stores results returned\n"
-"by args passed in, so that future calls with the same inputs can save work.\"\n"
-"  (let cache (table)\n"
-"    (fn args (aif (cache args) it (= (cache args) (apply f args))))))\n"
+"by args passed in, so that future calls with the same inputs can save work.\n"
+"Results are kept in 'cache'; pass a [[cache-table]] to bound it. A [[weak-table]]\n"
+"keeps almost nothing here: its keys are the fresh lists of arguments, which nothing\n"
+"else references, so each gc drops them. See [[memo1]].\"\n"
+"  (fn args (aif (cache args) it (= (cache args) (apply f args)))))\n"
+"\n"
+"(def memo1 (f (o cache (weak-table)))\n"
+"\"Like [[memo]] for a function 'f' of one argument, with results kept under the\n"
+"argument itself. By default 'cache' is a [[weak-table]], which keeps a result while\n"
+"its argument is reachable elsewhere.\"\n"
+"  (fn (x) (aif (cache x) it (= (cache x) (f x)))))\n"
 "\n"
 "(mac defmemo (name parms . body)\n"
 "\"Like [[def]] but defines a memoized function. See [[memo]].\"\n"
-"  `(assign ,name (memo (fn ,parms ,@body))))\n";
+"  `(assign ,name (memo (fn ,parms ,@body))))\n"
+"\n"
+"(mac thread body\n"
+"\"Runs 'body' in a new thread, which is returned. See [[dead]].\"\n"
+"  `(new-thread (fn () ,@body)))\n"
+"\n"
+"(mac atomic body\n"
+"\"Runs 'body' while no other thread runs.\"\n"
+"  `(atomic-invoke (fn () ,@body)))\n"
+"\n"
+"(mac atlet args\n"
+"\"Like [[let]], but [[atomic]].\"\n"
+"  `(atomic (let ,@args)))\n"
+"\n"
+"(mac atwith args\n"
+"\"Like [[with]], but [[atomic]].\"\n"
+"  `(atomic (with ,@args)))\n"
+"\n"
+"(mac atwiths args\n"
+"\"Like [[withs]], but [[atomic]].\"\n"
+"  `(atomic (withs ,@args)))\n"
+"\n"
+"(mac time (expr)\n"
+"\"Evaluates 'expr' and returns its value, after printing the milliseconds it\n"
+"took, the processor time it used and the time spent collecting garbage.\"\n"
+"  (w/uniq (t0 p0 g0 val)\n"
+"    `(withs (,t0 (msec) ,p0 (current-process-milliseconds) ,g0 (current-gc-milliseconds) ,val ,expr)\n"
+"       (prn \"time: \" (- (msec) ,t0) \" msec. cpu: \" (- (current-process-milliseconds) ,p0)\n"
+"            \" msec. gc: \" (- (current-gc-milliseconds) ,g0) \" msec.\")\n"
+"       ,val)))\n"
+"\n"
+"(mac bench (n expr)\n"
+"\"Evaluates 'expr' 'n' times after a tenth as many warmup runs. Prints and\n"
+"returns the minimum, median and 99th percentile milliseconds of one run.\n"
+"Counting the sorted runs from 0, the median is run n/2 and the 99th percentile\n"
+"run 0.99(n-1), both rounded down; so the median of an even count is the upper one.\"\n"
+"  (w/uniq (k f t0 v x res)\n"
+"    `(withs (,k ,n ,f (fn () ,expr) ,v (table))\n"
+"       (repeat (max 1 (trunc (/ ,k 10))) (,f))\n"
+"       (on ,x (sort < (n-of ,k (let ,t0 (msec) (,f) (- (msec) ,t0))))\n"
+"         (= (,v index) ,x))\n"
+"       (let ,res (list (,v 0) (,v (trunc (/ ,k 2))) (,v (trunc (* 0.99 (- ,k 1)))))\n"
+"         (prn \"min: \" (,res 0) \" median: \" (,res 1) \" p99: \" (,res 2) \" msec\")\n"
+"         ,res))))\n";